@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+#include "cpu.hpp"
+
+/* AHEAD-OF-TIME TRANSLATION
+ * =========================
+ * Every instruction statically reachable from program_bgn is lowered to C++ in a single function, which is
+ * compiled into a shared object with the host compiler ($CXX, or c++) and cached under $XDG_CACHE_HOME/riscv-emu
+ * (or ~/.cache/riscv-emu), keyed on the image contents. Later runs of the same image just load it. The cache
+ * directory is created private to the user, and translation fails if it's writable by anybody else.
+ *
+ * Native code hands control back to the interpreter at every instruction it doesn't lower (ECALL, AMOs,
+ * division, bitmanip), at loads and stores outside of memory (the UART, faults), and at jumps to code it
+ * didn't discover. It doesn't trace, count, simulate caches, or track dirty pages, and code that is
+ * overwritten after translation keeps running as it was.
+ * */
+
+// Returns the C++ source for the first image_size bytes of image
+std::string translate_image(const uint8_t *image, std::size_t image_size, const CpuConfig &cfg);
+
+class AotModule {
+public:
+    // Loads the module for the image at the start of cpu's memory, building it if it isn't cached. Throws
+    // std::runtime_error if compiling or loading fails.
+    AotModule(const Cpu &cpu, std::size_t image_size, const CpuConfig &cfg);
+    ~AotModule();
+
+    AotModule(const AotModule &) = delete;
+    AotModule &operator=(const AotModule &) = delete;
+
+    // Runs the guest until it exits, interpreting with `step` wherever native code gives up
+    int run(Cpu &cpu, step_fn step) const;
+
+private:
+    // Runs native code starting at pc, returning the pc of the first instruction it didn't execute
+    using entry_fn = uint64_t (*)(int64_t *registers, uint8_t *memory, uint64_t pc);
+
+    void *handle{nullptr};
+    entry_fn entry{nullptr};
+};
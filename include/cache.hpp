@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <iostream>
+#include <string_view>
+#include <optional>
+#include <span>
+#include <vector>
+#include <unordered_map>
+
+enum class ReplacementPolicy {
+    LRU,
+    FIFO,
+    RANDOM,
+};
+
+struct CacheLevelConfig {
+    std::size_t size;
+    std::size_t ways;
+    std::size_t line_size;
+    ReplacementPolicy policy{ReplacementPolicy::LRU};
+};
+
+// Parses SIZE:WAYS:LINE[:POLICY], where SIZE may end in k or m and POLICY is lru, fifo, or random
+std::optional<CacheLevelConfig> parse_cache_level(std::string_view spec);
+
+/* A single set associative, write-back, write-allocate cache. Only tags are kept, no data. Throws
+ * std::runtime_error if the geometry isn't made of powers of two.
+ * */
+class CacheLevel {
+public:
+    explicit CacheLevel(const CacheLevelConfig &cfg);
+
+    // Returns true on a hit. Misses allocate the line, evicting a victim picked by the replacement policy.
+    bool access(uint64_t addr, bool write);
+    std::size_t line_size() const { return cfg.line_size; }
+
+    uint64_t hits{0};
+    uint64_t misses{0};
+    uint64_t writebacks{0};
+
+private:
+    struct Way {
+        uint64_t tag{0};
+        // Last use for LRU, fill time for FIFO
+        uint64_t stamp{0};
+        bool valid{false};
+        bool dirty{false};
+    };
+
+    CacheLevelConfig cfg;
+    std::size_t sets;
+    std::vector<Way> lines;
+    uint64_t clock{0};
+    uint64_t rng_state{0x9e3779b97f4a7c15};
+};
+
+struct PcMisses {
+    uint64_t l1i{0};
+    uint64_t l1d{0};
+    uint64_t l2{0};
+};
+
+/* Split L1 instruction and data caches in front of a unified L2. L1 writebacks aren't forwarded to the L2, so
+ * the L2 only sees line fills.
+ * */
+struct CacheHierarchy {
+    CacheLevel l1i;
+    CacheLevel l1d;
+    CacheLevel l2;
+    // Keyed by the pc of the instruction that missed, only touched on misses
+    std::unordered_map<uint64_t, PcMisses> per_pc{};
+
+    CacheHierarchy(const CacheLevelConfig &l1i_cfg, const CacheLevelConfig &l1d_cfg, const CacheLevelConfig &l2_cfg);
+
+    void fetch(uint64_t pc);
+    void data(uint64_t pc, uint64_t addr, std::size_t size, bool write);
+    // Prints the totals of every level, followed by the `top` pcs with the most misses and their instructions as
+    // found in code, which starts at address 0
+    void report(std::ostream &os, std::size_t top, std::span<const uint8_t> code) const;
+};
+
+constexpr CacheLevelConfig default_l1i{.size = 32 * 1024, .ways = 8, .line_size = 64};
+constexpr CacheLevelConfig default_l1d{.size = 32 * 1024, .ways = 8, .line_size = 64};
+constexpr CacheLevelConfig default_l2{.size = 1024 * 1024, .ways = 16, .line_size = 64};
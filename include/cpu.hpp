@@ -5,10 +5,23 @@
 #include <array>
 #include <memory>
 #include <vector>
+#include <optional>
+#include <stdexcept>
+#include <bitset>
+#include <algorithm>
+#include <utility>
+
+#include "uart.hpp"
+#include "cache.hpp"
+#include "trace.hpp"
+#include "idiom.hpp"
+#include "mapping.hpp"
+#include "isa.hpp"
 
 constexpr std::size_t mem_size = 16 * 1024 * 1024; // 16 MiB
 constexpr std::size_t inst_buf_size = 65536; // 64 KiB
 constexpr std::size_t program_bgn = 0;
+constexpr std::size_t page_size = 4096;
 
 struct Reservation {
     std::size_t addr, inst;
@@ -16,55 +29,169 @@ struct Reservation {
 
 struct HartContext {
     std::optional<std::size_t> last_lr{std::nullopt};
+    // Address reserved by the last LR. Only used without Cpu::multi_hart, which goes through Cpu::reservations
+    // instead so that other harts' stores can break the reservation.
+    std::size_t lr_addr{0};
+    // Value the last LR loaded. SC only stores while memory still holds it, which also catches stores by harts
+    // running on other host threads, see scheduler.hpp.
+    uint64_t lr_value{0};
+};
+
+struct CpuStats {
+    uint64_t retired{0};
+    uint64_t branches_taken{0};
+    // Executed instructions by index into inst_specs
+    std::array<uint64_t, inst_specs.size()> insts{};
+
+    void dump(std::ostream &os) const;
+    CpuStats &operator+=(const CpuStats &other);
+};
+
+/* Features a Cpu is built with. Every handler is instantiated per configuration so that disabled features
+ * cost nothing in the fetch decode execute loop, rather than being checked at runtime. Cache simulation and
+ * binary traces aren't among them: they are rarely used, so rather than doubling the instances, the ones with
+ * statistics go through Cpu::caches and Cpu::tracer whenever those are present.
+ * */
+struct CpuConfig {
+    bool ext_m{true};
+    bool ext_a{true};
+    bool ext_b{true}; // Zba, Zbb, and Zbs
+    // 0: silent, 1: ECALL register dumps, 2: every fetched instruction as well
+    unsigned trace{1};
+    bool stats{false};
+    // Out of bounds accesses throw instead of wrapping around memory
+    bool checked_mem{true};
+
+    constexpr bool operator==(const CpuConfig &) const = default;
+};
+
+// Instructions of extensions a configuration leaves out stay undecoded, the same as any other unknown instruction
+constexpr bool has_ext(const CpuConfig &cfg, Ext ext) {
+    switch (ext) {
+    case Ext::I:
+        return true;
+    case Ext::M:
+        return cfg.ext_m;
+    case Ext::A:
+        return cfg.ext_a;
+    case Ext::B:
+        return cfg.ext_b;
+    }
+    return false;
+}
+
+// Loop idioms skip over whole loops at once, so they are left out of configurations observing every instruction.
+// Cache simulation and binary traces need statistics.
+constexpr bool supports_loop_idioms(const CpuConfig &cfg) {
+    return cfg.trace < 2 && !cfg.stats;
+}
+
+/* ECALL INTERFACE
+ * ===============
+ * The call number goes in x10 and its arguments in x11 and up. Hypercalls run bulk memory operations on the
+ * host, with the same arguments and x10 results as their C library namesakes. Their ranges must lie entirely
+ * in memory, even in unchecked configurations. See guest/ for wrappers.
+ * */
+enum ecall_nums {
+    // x11: exit code
+    ECALL_EXIT = 1,
+    // x11: dst, x12: src, x13: size
+    HYPERCALL_MEMCPY = 0x100,
+    HYPERCALL_MEMMOVE = 0x101,
+    // x11: dst, x12: byte, x13: size
+    HYPERCALL_MEMSET = 0x102,
+    // x11: lhs, x12: rhs, x13: size
+    HYPERCALL_MEMCMP = 0x103,
+    // x11: string
+    HYPERCALL_STRLEN = 0x104,
+};
+
+// Thrown by the run loop once Cpu::budget instructions have been executed
+struct BudgetExhausted : std::runtime_error {
+    using std::runtime_error::runtime_error;
 };
 
 struct Cpu {
     std::array<int64_t, 32> registers;
     uint64_t pc{program_bgn};
-    std::unique_ptr<std::array<uint8_t, mem_size>> memory{ new std::array<uint8_t, mem_size> };
+    // Shared with the Cpus of the scheduler's workers, see scheduler.hpp
+    std::shared_ptr<std::array<uint8_t, mem_size>> memory{ new std::array<uint8_t, mem_size> };
+    // LR reserves its address here rather than in its HartContext, so that stores and AMOs to it break the
+    // reservation. Stores only check for reservations, so this costs nothing while it's off.
+    bool multi_hart{false};
     std::vector<Reservation> reservations{};
     std::vector<HartContext> contexts{HartContext {}};
+    Uart uart{};
+    CpuStats stats{};
+    // Instructions left before the run loop gives up
+    uint64_t budget{UINT64_MAX};
+    // Pages written since the last reset, so it only has to clear those. Memory starts out uninitialized.
+    std::bitset<mem_size / page_size> dirty_pages{};
+    bool all_dirty{true};
+    // Fetches and data accesses go through these while present, which only configurations with stats check for
+    std::unique_ptr<CacheHierarchy> caches{};
+    // Retired instructions are streamed here while present, which only configurations with stats check for
+    std::unique_ptr<TraceWriter> tracer{};
+    // Loops are only matched against idioms while this is present, see idiom.hpp
+    std::unique_ptr<LoopIdiomCache> idioms{};
+    // Host files mapped above memory, see mapping.hpp
+    std::vector<FileMapping> mappings{};
 
     std::size_t cur_hart = 0;
+    // Instructions left in the running hart's time slice, see run_slice(). WFI and LR spinning on a reservation
+    // it couldn't complete end the slice early, and WFI also sets waiting.
+    uint64_t slice{0};
+    bool waiting{false};
+    // AMOs and successful SCs executed, any of which may be what a hart in WFI waits for
+    uint64_t wake_events{0};
+
+    Cpu() = default;
+    // Runs on memory shared with other Cpus instead of allocating its own, see scheduler.hpp
+    explicit Cpu(std::shared_ptr<std::array<uint8_t, mem_size>> shared) : memory{std::move(shared)} {}
 
     void reserve(std::size_t addr, std::size_t inst);
     std::optional<std::size_t> invalidate(std::size_t addr);
     void dump_regs();
+    // Puts the Cpu back into its just constructed state, except that memory is zeroed. The first reset touches
+    // every page of memory, later ones only what was written in between. Files are unmapped.
+    void reset();
+
+    // Maps the file at path to guest addresses from base up. base must be page aligned, and the file must fit
+    // above memory without overlapping the UART or other mappings. Throws std::runtime_error otherwise.
+    void map_file(const char *path, uint64_t base, MapMode mode);
+    // The mapping holding addr, or nullptr
+    const FileMapping *mapping_at(uint64_t addr) const;
+    // Returns where an access lives on the host if it's to a mapping, or nullptr if it isn't. Faults on accesses
+    // running off the end of a mapping, and on writes to read-only ones.
+    uint8_t *mapped(uint64_t addr, std::size_t size, bool write) {
+        if (addr < mem_size || mappings.empty())
+            return nullptr;
+        return lookup_mapping(addr, size, write);
+    }
+    uint8_t *lookup_mapping(uint64_t addr, std::size_t size, bool write);
+
+    void mark_dirty(std::size_t addr, std::size_t size) {
+        auto last = std::min((addr + size - 1) / page_size, dirty_pages.size() - 1);
+        for (auto page = addr / page_size; page <= last; page++)
+            dirty_pages.set(page);
+    }
 };
 
-enum opcodes {
-    OP_LOAD = 0b0000011,
-    OP_LOAD_FP = 0b0000111,
-    OP_MISC_MEM = 0b0001111,
-    OP_OP_IMM = 0b0010011,
-    OP_AUIPC = 0b0010111,
-    OP_OP_IMM_32 = 0b0011011,
-
-    OP_STORE = 0b0100011,
-    OP_STORE_FP = 0b0100111,
-    OP_AMO = 0b0101111,
-    OP_OP = 0b0110011,
-    OP_LUI = 0b0110111,
-    OP_OP_32 = 0b0111011,
-
-    OP_MADD = 0b1000011,
-    OP_MSUB = 0b1000111,
-    OP_NMSUB = 0b1001011,
-    OP_NMADD = 0b1001111,
-    OP_OP_FP = 0b1010011,
-
-    OP_BRANCH = 0b1100011,
-    OP_JALR = 0b1100111,
-    OP_JAL = 0b1101011,
-    OP_SYSTEM = 0b1110011,
+// Executes the instruction at pc, returning the guest's exit code if it exited
+template<CpuConfig cfg> std::optional<int> step(Cpu &cpu);
+// Runs the fetch decode execute loop until the guest exits, returning its exit code
+template<CpuConfig cfg> int run(Cpu &cpu);
+// Runs until Cpu::slice reaches zero, returning the guest's exit code if it exited first
+template<CpuConfig cfg> std::optional<int> run_slice(Cpu &cpu);
+
+using run_fn = int (*)(Cpu &cpu);
+using step_fn = std::optional<int> (*)(Cpu &cpu);
+
+struct CpuVariant {
+    run_fn run;
+    step_fn step;
+    step_fn slice;
 };
 
-void handle_op_im(uint32_t inst, Cpu &cpu);
-void handle_op_im_32(uint32_t inst, Cpu &cpu);
-void handle_op_op(uint32_t inst, Cpu &cpu);
-void handle_op_op_32(uint32_t inst, Cpu &cpu);
-void handle_op_branch(uint32_t inst, Cpu &cpu);
-void handle_op_load(uint32_t inst, Cpu &cpu);
-void handle_op_store(uint32_t inst, Cpu &cpu);
-void handle_op_amo(uint32_t inst, Cpu &cpu);
-std::optional<int> handle_op_system(uint32_t inst, Cpu &cpu);
+// Returns the pre-instantiated interpreter for a configuration, or nullptr if it wasn't built
+const CpuVariant *select_variant(const CpuConfig &cfg);
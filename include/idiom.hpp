@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <unordered_map>
+
+#include "isa.hpp"
+
+/* LOOP IDIOMS
+ * ===========
+ * Compilers turn byte and word copy and fill loops into a handful of instructions: a load and a store, or just
+ * a store, through pointers bumped by the element size, and a backward branch comparing one of the bumped
+ * registers against a bound. For example:
+ *
+ *   loop: lbu  a5, 0(a1)          loop: sb   a1, 0(a0)
+ *         addi a1, a1, 1                addi a0, a0, 1
+ *         addi a0, a0, 1                bne  a0, a2, loop
+ *         sb   a5, -1(a0)
+ *         bne  a1, a2, loop
+ *
+ * When such a loop's branch is taken, the number of iterations left follows from the registers, so all of them
+ * can be run at once with a host memmove or fill and the registers set to what the last iteration leaves
+ * behind. Only loops made of nothing but ADDI inductions (rd == rs1), one load, one store, and a closing BNE,
+ * BLT, or BLTU are matched.
+ * */
+
+enum class IdiomKind {
+    NONE,
+    // *dst++ = *src++
+    COPY,
+    // *dst++ = value
+    FILL,
+};
+
+struct Induction {
+    std::size_t reg;
+    int64_t step;
+};
+
+struct LoopIdiom {
+    IdiomKind kind{IdiomKind::NONE};
+    uint64_t head{0};
+    // The loop's instructions from head up to and including the branch, to notice when it's overwritten. Only
+    // kept for matches, a loop that stops being a mismatch is merely missed.
+    std::vector<uint32_t> body{};
+
+    // Element size in bytes, the stride of both pointers
+    std::size_t width{0};
+    std::vector<Induction> inductions{};
+
+    // Address of the next iteration's store (and load) is the register plus the offset
+    std::size_t dst_reg{0};
+    int64_t dst_offset{0};
+    std::size_t src_reg{0};
+    int64_t src_offset{0};
+    // COPY: where the loaded element ends up, FILL: the register that is stored
+    std::size_t value_reg{0};
+    bool load_signed{false};
+
+    // The branch keeps looping while `branch_cond(registers[counter], registers[bound])` holds, or with the
+    // operands swapped for BNE. branch_cond is the branch's op from inst_specs, counter is one of the inductions.
+    alu_fn branch_cond{nullptr};
+    std::size_t counter{0};
+    int64_t counter_step{0};
+    std::size_t bound{0};
+};
+
+// Matches the loop from head up to and including the backward branch at branch_pc
+LoopIdiom match_loop_idiom(const uint8_t *memory, uint64_t head, uint64_t branch_pc);
+
+// Remaining iterations of a matched loop whose branch was just taken, or 0 if they can't be worked out
+uint64_t loop_idiom_trip_count(const LoopIdiom &idiom, const int64_t *registers);
+
+// Matched loops by the pc of their branch, including the ones that didn't match anything
+using LoopIdiomCache = std::unordered_map<uint64_t, LoopIdiom>;
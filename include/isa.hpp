@@ -0,0 +1,471 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+enum opcodes {
+    OP_LOAD = 0b0000011,
+    OP_LOAD_FP = 0b0000111,
+    OP_MISC_MEM = 0b0001111,
+    OP_OP_IMM = 0b0010011,
+    OP_AUIPC = 0b0010111,
+    OP_OP_IMM_32 = 0b0011011,
+
+    OP_STORE = 0b0100011,
+    OP_STORE_FP = 0b0100111,
+    OP_AMO = 0b0101111,
+    OP_OP = 0b0110011,
+    OP_LUI = 0b0110111,
+    OP_OP_32 = 0b0111011,
+
+    OP_MADD = 0b1000011,
+    OP_MSUB = 0b1000111,
+    OP_NMSUB = 0b1001011,
+    OP_NMADD = 0b1001111,
+    OP_OP_FP = 0b1010011,
+
+    OP_BRANCH = 0b1100011,
+    OP_JALR = 0b1100111,
+    OP_JAL = 0b1101111,
+    OP_SYSTEM = 0b1110011,
+};
+
+/* INSTRUCTION SET
+ * ===============
+ * Every instruction the emulator knows is described once, in inst_specs: the bits that tell it apart (mask and
+ * match), how its operands are encoded, the extension it's part of, and what it does. The decode table, the
+ * interpreter's handler tables (see cpu.cpp), and the disassembler are all generated from it at compile time.
+ *
+ * ALU instructions are described by an operation on the value of rs1 and either the value of rs2 or the sign
+ * extended immediate. Immediate shifts and single bit instructions get the whole immediate, funct6 included, and
+ * mask the shift amount out of it themselves, so they share their operation with the register form. Unary
+ * instructions ignore the second operand.
+ * */
+
+enum class Ext : uint8_t {
+    I,
+    M,
+    A,
+    // Zba, Zbb, and Zbs
+    B,
+};
+
+// How the operands are encoded, and so how they're disassembled
+enum class Format : uint8_t {
+    NONE,
+    // rd, rs1, rs2
+    R,
+    // rd, rs1
+    R_UNARY,
+    // rd, rs1, imm
+    I,
+    // rd, rs1, shamt
+    I_SHIFT,
+    // rd, imm(rs1), loads and JALR
+    I_MEM,
+    // rs2, imm(rs1)
+    S,
+    // rs1, rs2, target
+    B,
+    // rd, imm
+    U,
+    // rd, target
+    J,
+    // rd, rs2, (rs1)
+    AMO,
+    // rd, (rs1)
+    LR,
+};
+
+enum class Kind : uint8_t {
+    UNKNOWN,
+    // rd = op(rs1, rs2)
+    ALU,
+    // rd = op(rs1, imm)
+    ALU_IMM,
+    LUI,
+    AUIPC,
+    JAL,
+    JALR,
+    // Taken if op(rs1, rs2) is nonzero
+    BRANCH,
+    LOAD,
+    STORE,
+    // LR, SC, and the AMOs, told apart by funct5
+    AMO,
+    FENCE,
+    ECALL,
+    EBREAK,
+    // Gives up the rest of the hart's time slice, see scheduler.hpp
+    WFI,
+};
+
+using alu_fn = int64_t (*)(int64_t a, int64_t b);
+
+struct InstSpec {
+    const char *name;
+    uint32_t mask;
+    uint32_t match;
+    Format format;
+    Ext ext;
+    Kind kind;
+    // ALU, ALU_IMM, and BRANCH
+    alu_fn op{nullptr};
+    // LOAD, STORE, and AMO: access size in bytes
+    uint8_t size{0};
+    // LOAD: sign extends the loaded value
+    bool is_signed{false};
+};
+
+[[nodiscard]] constexpr int64_t sext_w(uint64_t value) {
+    return static_cast<int32_t>(value);
+}
+
+// RV64I
+constexpr int64_t alu_add(int64_t a, int64_t b) { return static_cast<uint64_t>(a) + static_cast<uint64_t>(b); }
+constexpr int64_t alu_sub(int64_t a, int64_t b) { return static_cast<uint64_t>(a) - static_cast<uint64_t>(b); }
+constexpr int64_t alu_sll(int64_t a, int64_t b) { return static_cast<uint64_t>(a) << (b & 0x3f); }
+constexpr int64_t alu_srl(int64_t a, int64_t b) { return static_cast<uint64_t>(a) >> (b & 0x3f); }
+constexpr int64_t alu_sra(int64_t a, int64_t b) { return a >> (b & 0x3f); }
+constexpr int64_t alu_slt(int64_t a, int64_t b) { return a < b; }
+constexpr int64_t alu_sltu(int64_t a, int64_t b) { return static_cast<uint64_t>(a) < static_cast<uint64_t>(b); }
+constexpr int64_t alu_xor(int64_t a, int64_t b) { return a ^ b; }
+constexpr int64_t alu_or(int64_t a, int64_t b) { return a | b; }
+constexpr int64_t alu_and(int64_t a, int64_t b) { return a & b; }
+constexpr int64_t alu_addw(int64_t a, int64_t b) { return sext_w(a + static_cast<uint64_t>(b)); }
+constexpr int64_t alu_subw(int64_t a, int64_t b) { return sext_w(a - static_cast<uint64_t>(b)); }
+constexpr int64_t alu_sllw(int64_t a, int64_t b) { return sext_w(static_cast<uint32_t>(a) << (b & 0x1f)); }
+constexpr int64_t alu_srlw(int64_t a, int64_t b) { return sext_w(static_cast<uint32_t>(a) >> (b & 0x1f)); }
+constexpr int64_t alu_sraw(int64_t a, int64_t b) { return static_cast<int32_t>(a) >> (b & 0x1f); }
+
+// Branch conditions, the ones not shared with SLT and SLTU
+constexpr int64_t alu_eq(int64_t a, int64_t b) { return a == b; }
+constexpr int64_t alu_ne(int64_t a, int64_t b) { return a != b; }
+constexpr int64_t alu_sge(int64_t a, int64_t b) { return a >= b; }
+constexpr int64_t alu_sgeu(int64_t a, int64_t b) { return static_cast<uint64_t>(a) >= static_cast<uint64_t>(b); }
+
+// M. Division by zero and overflow give the results the spec defines rather than trapping.
+constexpr int64_t alu_mul(int64_t a, int64_t b) { return static_cast<uint64_t>(a) * static_cast<uint64_t>(b); }
+constexpr int64_t alu_mulh(int64_t a, int64_t b) {
+    return (static_cast<__int128_t>(a) * b) >> 64;
+}
+constexpr int64_t alu_mulhsu(int64_t a, int64_t b) {
+    return (static_cast<__int128_t>(a) * static_cast<__int128_t>(static_cast<uint64_t>(b))) >> 64;
+}
+constexpr int64_t alu_mulhu(int64_t a, int64_t b) {
+    return (static_cast<__uint128_t>(static_cast<uint64_t>(a)) * static_cast<uint64_t>(b)) >> 64;
+}
+constexpr int64_t alu_div(int64_t a, int64_t b) {
+    if (b == 0)
+        return -1;
+    if (b == -1 && a == INT64_MIN)
+        return a;
+    return a / b;
+}
+constexpr int64_t alu_divu(int64_t a, int64_t b) {
+    return b == 0 ? -1 : static_cast<int64_t>(static_cast<uint64_t>(a) / static_cast<uint64_t>(b));
+}
+constexpr int64_t alu_rem(int64_t a, int64_t b) {
+    if (b == 0)
+        return a;
+    if (b == -1 && a == INT64_MIN)
+        return 0;
+    return a % b;
+}
+constexpr int64_t alu_remu(int64_t a, int64_t b) {
+    return b == 0 ? a : static_cast<int64_t>(static_cast<uint64_t>(a) % static_cast<uint64_t>(b));
+}
+constexpr int64_t alu_mulw(int64_t a, int64_t b) {
+    return sext_w(static_cast<uint32_t>(a) * static_cast<uint32_t>(b));
+}
+// Dividing the lowest word by -1 doesn't overflow 64 bits, and wraps back around to it
+constexpr int64_t alu_divw(int64_t a, int64_t b) {
+    return sext_w(alu_div(static_cast<int32_t>(a), static_cast<int32_t>(b)));
+}
+constexpr int64_t alu_divuw(int64_t a, int64_t b) {
+    return sext_w(alu_divu(static_cast<uint32_t>(a), static_cast<uint32_t>(b)));
+}
+constexpr int64_t alu_remw(int64_t a, int64_t b) {
+    return sext_w(alu_rem(static_cast<int32_t>(a), static_cast<int32_t>(b)));
+}
+constexpr int64_t alu_remuw(int64_t a, int64_t b) {
+    return sext_w(alu_remu(static_cast<uint32_t>(a), static_cast<uint32_t>(b)));
+}
+
+// Zba
+constexpr int64_t alu_sh1add(int64_t a, int64_t b) { return (static_cast<uint64_t>(a) << 1) + b; }
+constexpr int64_t alu_sh2add(int64_t a, int64_t b) { return (static_cast<uint64_t>(a) << 2) + b; }
+constexpr int64_t alu_sh3add(int64_t a, int64_t b) { return (static_cast<uint64_t>(a) << 3) + b; }
+constexpr int64_t alu_add_uw(int64_t a, int64_t b) { return static_cast<uint32_t>(a) + static_cast<uint64_t>(b); }
+constexpr int64_t alu_sh1add_uw(int64_t a, int64_t b) { return alu_sh1add(static_cast<uint32_t>(a), b); }
+constexpr int64_t alu_sh2add_uw(int64_t a, int64_t b) { return alu_sh2add(static_cast<uint32_t>(a), b); }
+constexpr int64_t alu_sh3add_uw(int64_t a, int64_t b) { return alu_sh3add(static_cast<uint32_t>(a), b); }
+constexpr int64_t alu_slli_uw(int64_t a, int64_t b) { return alu_sll(static_cast<uint32_t>(a), b); }
+
+// Zbb
+constexpr int64_t alu_andn(int64_t a, int64_t b) { return a & ~b; }
+constexpr int64_t alu_orn(int64_t a, int64_t b) { return a | ~b; }
+constexpr int64_t alu_xnor(int64_t a, int64_t b) { return ~(a ^ b); }
+constexpr int64_t alu_max(int64_t a, int64_t b) { return a > b ? a : b; }
+constexpr int64_t alu_min(int64_t a, int64_t b) { return a < b ? a : b; }
+constexpr int64_t alu_maxu(int64_t a, int64_t b) { return alu_sltu(a, b) ? b : a; }
+constexpr int64_t alu_minu(int64_t a, int64_t b) { return alu_sltu(a, b) ? a : b; }
+constexpr int64_t alu_rol(int64_t a, int64_t b) { return std::rotl(static_cast<uint64_t>(a), b & 0x3f); }
+constexpr int64_t alu_ror(int64_t a, int64_t b) { return std::rotr(static_cast<uint64_t>(a), b & 0x3f); }
+constexpr int64_t alu_rolw(int64_t a, int64_t b) { return sext_w(std::rotl(static_cast<uint32_t>(a), b & 0x1f)); }
+constexpr int64_t alu_rorw(int64_t a, int64_t b) { return sext_w(std::rotr(static_cast<uint32_t>(a), b & 0x1f)); }
+constexpr int64_t alu_clz(int64_t a, int64_t) { return std::countl_zero(static_cast<uint64_t>(a)); }
+constexpr int64_t alu_ctz(int64_t a, int64_t) { return std::countr_zero(static_cast<uint64_t>(a)); }
+constexpr int64_t alu_cpop(int64_t a, int64_t) { return std::popcount(static_cast<uint64_t>(a)); }
+constexpr int64_t alu_clzw(int64_t a, int64_t) { return std::countl_zero(static_cast<uint32_t>(a)); }
+constexpr int64_t alu_ctzw(int64_t a, int64_t) { return std::countr_zero(static_cast<uint32_t>(a)); }
+constexpr int64_t alu_cpopw(int64_t a, int64_t) { return std::popcount(static_cast<uint32_t>(a)); }
+constexpr int64_t alu_sext_b(int64_t a, int64_t) { return static_cast<int8_t>(a); }
+constexpr int64_t alu_sext_h(int64_t a, int64_t) { return static_cast<int16_t>(a); }
+constexpr int64_t alu_zext_h(int64_t a, int64_t) { return static_cast<uint16_t>(a); }
+constexpr int64_t alu_rev8(int64_t a, int64_t) { return std::byteswap(static_cast<uint64_t>(a)); }
+constexpr int64_t alu_orc_b(int64_t a, int64_t) {
+    uint64_t res = 0;
+    for (unsigned shift = 0; shift < 64; shift += 8) {
+        if ((static_cast<uint64_t>(a) >> shift) & 0xff)
+            res |= uint64_t{0xff} << shift;
+    }
+    return res;
+}
+
+// Zbs
+constexpr int64_t alu_bclr(int64_t a, int64_t b) { return a & ~(int64_t{1} << (b & 0x3f)); }
+constexpr int64_t alu_bext(int64_t a, int64_t b) { return (static_cast<uint64_t>(a) >> (b & 0x3f)) & 1; }
+constexpr int64_t alu_binv(int64_t a, int64_t b) { return a ^ (int64_t{1} << (b & 0x3f)); }
+constexpr int64_t alu_bset(int64_t a, int64_t b) { return a | (int64_t{1} << (b & 0x3f)); }
+
+// Bits an instruction is identified by, from the narrowest to the widest
+constexpr uint32_t mask_opcode = 0x0000007f;
+constexpr uint32_t mask_funct3 = 0x0000707f;
+constexpr uint32_t mask_funct6 = 0xfc00707f;
+constexpr uint32_t mask_funct7 = 0xfe00707f;
+constexpr uint32_t mask_funct12 = 0xfff0707f;
+// funct5, funct3, and opcode, leaving out the aq and rl bits
+constexpr uint32_t mask_amo = 0xf800707f;
+constexpr uint32_t mask_lr = 0xf9f0707f;
+constexpr uint32_t mask_all = 0xffffffff;
+
+[[nodiscard]] constexpr uint32_t encode(uint32_t opcode, uint32_t funct3 = 0, uint32_t funct7 = 0) {
+    return opcode | funct3 << 12 | funct7 << 25;
+}
+
+// For encodings that fix the whole immediate of an I-type instruction
+[[nodiscard]] constexpr uint32_t encode12(uint32_t opcode, uint32_t funct3, uint32_t funct12) {
+    return opcode | funct3 << 12 | funct12 << 20;
+}
+
+// The first entry stands for every encoding that isn't in the table
+constexpr std::array inst_specs{
+    InstSpec{"unknown", 0, 0, Format::NONE, Ext::I, Kind::UNKNOWN},
+
+    // RV64I
+    InstSpec{"lui", mask_opcode, encode(OP_LUI), Format::U, Ext::I, Kind::LUI},
+    InstSpec{"auipc", mask_opcode, encode(OP_AUIPC), Format::U, Ext::I, Kind::AUIPC},
+    InstSpec{"jal", mask_opcode, encode(OP_JAL), Format::J, Ext::I, Kind::JAL},
+    InstSpec{"jalr", mask_funct3, encode(OP_JALR), Format::I_MEM, Ext::I, Kind::JALR},
+    InstSpec{"beq", mask_funct3, encode(OP_BRANCH, 0b000), Format::B, Ext::I, Kind::BRANCH, alu_eq},
+    InstSpec{"bne", mask_funct3, encode(OP_BRANCH, 0b001), Format::B, Ext::I, Kind::BRANCH, alu_ne},
+    InstSpec{"blt", mask_funct3, encode(OP_BRANCH, 0b100), Format::B, Ext::I, Kind::BRANCH, alu_slt},
+    InstSpec{"bge", mask_funct3, encode(OP_BRANCH, 0b101), Format::B, Ext::I, Kind::BRANCH, alu_sge},
+    InstSpec{"bltu", mask_funct3, encode(OP_BRANCH, 0b110), Format::B, Ext::I, Kind::BRANCH, alu_sltu},
+    InstSpec{"bgeu", mask_funct3, encode(OP_BRANCH, 0b111), Format::B, Ext::I, Kind::BRANCH, alu_sgeu},
+    InstSpec{"lb", mask_funct3, encode(OP_LOAD, 0b000), Format::I_MEM, Ext::I, Kind::LOAD, nullptr, 1, true},
+    InstSpec{"lh", mask_funct3, encode(OP_LOAD, 0b001), Format::I_MEM, Ext::I, Kind::LOAD, nullptr, 2, true},
+    InstSpec{"lw", mask_funct3, encode(OP_LOAD, 0b010), Format::I_MEM, Ext::I, Kind::LOAD, nullptr, 4, true},
+    InstSpec{"ld", mask_funct3, encode(OP_LOAD, 0b011), Format::I_MEM, Ext::I, Kind::LOAD, nullptr, 8, true},
+    InstSpec{"lbu", mask_funct3, encode(OP_LOAD, 0b100), Format::I_MEM, Ext::I, Kind::LOAD, nullptr, 1},
+    InstSpec{"lhu", mask_funct3, encode(OP_LOAD, 0b101), Format::I_MEM, Ext::I, Kind::LOAD, nullptr, 2},
+    InstSpec{"lwu", mask_funct3, encode(OP_LOAD, 0b110), Format::I_MEM, Ext::I, Kind::LOAD, nullptr, 4},
+    InstSpec{"sb", mask_funct3, encode(OP_STORE, 0b000), Format::S, Ext::I, Kind::STORE, nullptr, 1},
+    InstSpec{"sh", mask_funct3, encode(OP_STORE, 0b001), Format::S, Ext::I, Kind::STORE, nullptr, 2},
+    InstSpec{"sw", mask_funct3, encode(OP_STORE, 0b010), Format::S, Ext::I, Kind::STORE, nullptr, 4},
+    InstSpec{"sd", mask_funct3, encode(OP_STORE, 0b011), Format::S, Ext::I, Kind::STORE, nullptr, 8},
+    InstSpec{"addi", mask_funct3, encode(OP_OP_IMM, 0b000), Format::I, Ext::I, Kind::ALU_IMM, alu_add},
+    InstSpec{"slti", mask_funct3, encode(OP_OP_IMM, 0b010), Format::I, Ext::I, Kind::ALU_IMM, alu_slt},
+    InstSpec{"sltiu", mask_funct3, encode(OP_OP_IMM, 0b011), Format::I, Ext::I, Kind::ALU_IMM, alu_sltu},
+    InstSpec{"xori", mask_funct3, encode(OP_OP_IMM, 0b100), Format::I, Ext::I, Kind::ALU_IMM, alu_xor},
+    InstSpec{"ori", mask_funct3, encode(OP_OP_IMM, 0b110), Format::I, Ext::I, Kind::ALU_IMM, alu_or},
+    InstSpec{"andi", mask_funct3, encode(OP_OP_IMM, 0b111), Format::I, Ext::I, Kind::ALU_IMM, alu_and},
+    InstSpec{"slli", mask_funct6, encode(OP_OP_IMM, 0b001), Format::I_SHIFT, Ext::I, Kind::ALU_IMM, alu_sll},
+    InstSpec{"srli", mask_funct6, encode(OP_OP_IMM, 0b101), Format::I_SHIFT, Ext::I, Kind::ALU_IMM, alu_srl},
+    InstSpec{"srai", mask_funct6, encode(OP_OP_IMM, 0b101, 0b0100000), Format::I_SHIFT, Ext::I, Kind::ALU_IMM,
+        alu_sra},
+    InstSpec{"add", mask_funct7, encode(OP_OP, 0b000), Format::R, Ext::I, Kind::ALU, alu_add},
+    InstSpec{"sub", mask_funct7, encode(OP_OP, 0b000, 0b0100000), Format::R, Ext::I, Kind::ALU, alu_sub},
+    InstSpec{"sll", mask_funct7, encode(OP_OP, 0b001), Format::R, Ext::I, Kind::ALU, alu_sll},
+    InstSpec{"slt", mask_funct7, encode(OP_OP, 0b010), Format::R, Ext::I, Kind::ALU, alu_slt},
+    InstSpec{"sltu", mask_funct7, encode(OP_OP, 0b011), Format::R, Ext::I, Kind::ALU, alu_sltu},
+    InstSpec{"xor", mask_funct7, encode(OP_OP, 0b100), Format::R, Ext::I, Kind::ALU, alu_xor},
+    InstSpec{"srl", mask_funct7, encode(OP_OP, 0b101), Format::R, Ext::I, Kind::ALU, alu_srl},
+    InstSpec{"sra", mask_funct7, encode(OP_OP, 0b101, 0b0100000), Format::R, Ext::I, Kind::ALU, alu_sra},
+    InstSpec{"or", mask_funct7, encode(OP_OP, 0b110), Format::R, Ext::I, Kind::ALU, alu_or},
+    InstSpec{"and", mask_funct7, encode(OP_OP, 0b111), Format::R, Ext::I, Kind::ALU, alu_and},
+    InstSpec{"addiw", mask_funct3, encode(OP_OP_IMM_32, 0b000), Format::I, Ext::I, Kind::ALU_IMM, alu_addw},
+    InstSpec{"slliw", mask_funct7, encode(OP_OP_IMM_32, 0b001), Format::I_SHIFT, Ext::I, Kind::ALU_IMM, alu_sllw},
+    InstSpec{"srliw", mask_funct7, encode(OP_OP_IMM_32, 0b101), Format::I_SHIFT, Ext::I, Kind::ALU_IMM, alu_srlw},
+    InstSpec{"sraiw", mask_funct7, encode(OP_OP_IMM_32, 0b101, 0b0100000), Format::I_SHIFT, Ext::I, Kind::ALU_IMM,
+        alu_sraw},
+    InstSpec{"addw", mask_funct7, encode(OP_OP_32, 0b000), Format::R, Ext::I, Kind::ALU, alu_addw},
+    InstSpec{"subw", mask_funct7, encode(OP_OP_32, 0b000, 0b0100000), Format::R, Ext::I, Kind::ALU, alu_subw},
+    InstSpec{"sllw", mask_funct7, encode(OP_OP_32, 0b001), Format::R, Ext::I, Kind::ALU, alu_sllw},
+    InstSpec{"srlw", mask_funct7, encode(OP_OP_32, 0b101), Format::R, Ext::I, Kind::ALU, alu_srlw},
+    InstSpec{"sraw", mask_funct7, encode(OP_OP_32, 0b101, 0b0100000), Format::R, Ext::I, Kind::ALU, alu_sraw},
+    InstSpec{"fence", mask_funct3, encode(OP_MISC_MEM, 0b000), Format::NONE, Ext::I, Kind::FENCE},
+    InstSpec{"ecall", mask_all, encode12(OP_SYSTEM, 0b000, 0), Format::NONE, Ext::I, Kind::ECALL},
+    InstSpec{"ebreak", mask_all, encode12(OP_SYSTEM, 0b000, 1), Format::NONE, Ext::I, Kind::EBREAK},
+    InstSpec{"wfi", mask_all, encode12(OP_SYSTEM, 0b000, 0x105), Format::NONE, Ext::I, Kind::WFI},
+
+    // M
+    InstSpec{"mul", mask_funct7, encode(OP_OP, 0b000, 0b0000001), Format::R, Ext::M, Kind::ALU, alu_mul},
+    InstSpec{"mulh", mask_funct7, encode(OP_OP, 0b001, 0b0000001), Format::R, Ext::M, Kind::ALU, alu_mulh},
+    InstSpec{"mulhsu", mask_funct7, encode(OP_OP, 0b010, 0b0000001), Format::R, Ext::M, Kind::ALU, alu_mulhsu},
+    InstSpec{"mulhu", mask_funct7, encode(OP_OP, 0b011, 0b0000001), Format::R, Ext::M, Kind::ALU, alu_mulhu},
+    InstSpec{"div", mask_funct7, encode(OP_OP, 0b100, 0b0000001), Format::R, Ext::M, Kind::ALU, alu_div},
+    InstSpec{"divu", mask_funct7, encode(OP_OP, 0b101, 0b0000001), Format::R, Ext::M, Kind::ALU, alu_divu},
+    InstSpec{"rem", mask_funct7, encode(OP_OP, 0b110, 0b0000001), Format::R, Ext::M, Kind::ALU, alu_rem},
+    InstSpec{"remu", mask_funct7, encode(OP_OP, 0b111, 0b0000001), Format::R, Ext::M, Kind::ALU, alu_remu},
+    InstSpec{"mulw", mask_funct7, encode(OP_OP_32, 0b000, 0b0000001), Format::R, Ext::M, Kind::ALU, alu_mulw},
+    InstSpec{"divw", mask_funct7, encode(OP_OP_32, 0b100, 0b0000001), Format::R, Ext::M, Kind::ALU, alu_divw},
+    InstSpec{"divuw", mask_funct7, encode(OP_OP_32, 0b101, 0b0000001), Format::R, Ext::M, Kind::ALU, alu_divuw},
+    InstSpec{"remw", mask_funct7, encode(OP_OP_32, 0b110, 0b0000001), Format::R, Ext::M, Kind::ALU, alu_remw},
+    InstSpec{"remuw", mask_funct7, encode(OP_OP_32, 0b111, 0b0000001), Format::R, Ext::M, Kind::ALU, alu_remuw},
+
+    // A
+    InstSpec{"lr.w", mask_lr, encode(OP_AMO, 0b010, 0b0001000), Format::LR, Ext::A, Kind::AMO, nullptr, 4},
+    InstSpec{"sc.w", mask_amo, encode(OP_AMO, 0b010, 0b0001100), Format::AMO, Ext::A, Kind::AMO, nullptr, 4},
+    InstSpec{"amoswap.w", mask_amo, encode(OP_AMO, 0b010, 0b0000100), Format::AMO, Ext::A, Kind::AMO, nullptr, 4},
+    InstSpec{"amoadd.w", mask_amo, encode(OP_AMO, 0b010, 0b0000000), Format::AMO, Ext::A, Kind::AMO, nullptr, 4},
+    InstSpec{"amoxor.w", mask_amo, encode(OP_AMO, 0b010, 0b0010000), Format::AMO, Ext::A, Kind::AMO, nullptr, 4},
+    InstSpec{"amoand.w", mask_amo, encode(OP_AMO, 0b010, 0b0110000), Format::AMO, Ext::A, Kind::AMO, nullptr, 4},
+    InstSpec{"amoor.w", mask_amo, encode(OP_AMO, 0b010, 0b0100000), Format::AMO, Ext::A, Kind::AMO, nullptr, 4},
+    InstSpec{"amomin.w", mask_amo, encode(OP_AMO, 0b010, 0b1000000), Format::AMO, Ext::A, Kind::AMO, nullptr, 4},
+    InstSpec{"amomax.w", mask_amo, encode(OP_AMO, 0b010, 0b1010000), Format::AMO, Ext::A, Kind::AMO, nullptr, 4},
+    InstSpec{"amominu.w", mask_amo, encode(OP_AMO, 0b010, 0b1100000), Format::AMO, Ext::A, Kind::AMO, nullptr, 4},
+    InstSpec{"amomaxu.w", mask_amo, encode(OP_AMO, 0b010, 0b1110000), Format::AMO, Ext::A, Kind::AMO, nullptr, 4},
+    InstSpec{"lr.d", mask_lr, encode(OP_AMO, 0b011, 0b0001000), Format::LR, Ext::A, Kind::AMO, nullptr, 8},
+    InstSpec{"sc.d", mask_amo, encode(OP_AMO, 0b011, 0b0001100), Format::AMO, Ext::A, Kind::AMO, nullptr, 8},
+    InstSpec{"amoswap.d", mask_amo, encode(OP_AMO, 0b011, 0b0000100), Format::AMO, Ext::A, Kind::AMO, nullptr, 8},
+    InstSpec{"amoadd.d", mask_amo, encode(OP_AMO, 0b011, 0b0000000), Format::AMO, Ext::A, Kind::AMO, nullptr, 8},
+    InstSpec{"amoxor.d", mask_amo, encode(OP_AMO, 0b011, 0b0010000), Format::AMO, Ext::A, Kind::AMO, nullptr, 8},
+    InstSpec{"amoand.d", mask_amo, encode(OP_AMO, 0b011, 0b0110000), Format::AMO, Ext::A, Kind::AMO, nullptr, 8},
+    InstSpec{"amoor.d", mask_amo, encode(OP_AMO, 0b011, 0b0100000), Format::AMO, Ext::A, Kind::AMO, nullptr, 8},
+    InstSpec{"amomin.d", mask_amo, encode(OP_AMO, 0b011, 0b1000000), Format::AMO, Ext::A, Kind::AMO, nullptr, 8},
+    InstSpec{"amomax.d", mask_amo, encode(OP_AMO, 0b011, 0b1010000), Format::AMO, Ext::A, Kind::AMO, nullptr, 8},
+    InstSpec{"amominu.d", mask_amo, encode(OP_AMO, 0b011, 0b1100000), Format::AMO, Ext::A, Kind::AMO, nullptr, 8},
+    InstSpec{"amomaxu.d", mask_amo, encode(OP_AMO, 0b011, 0b1110000), Format::AMO, Ext::A, Kind::AMO, nullptr, 8},
+
+    // Zba
+    InstSpec{"sh1add", mask_funct7, encode(OP_OP, 0b010, 0b0010000), Format::R, Ext::B, Kind::ALU, alu_sh1add},
+    InstSpec{"sh2add", mask_funct7, encode(OP_OP, 0b100, 0b0010000), Format::R, Ext::B, Kind::ALU, alu_sh2add},
+    InstSpec{"sh3add", mask_funct7, encode(OP_OP, 0b110, 0b0010000), Format::R, Ext::B, Kind::ALU, alu_sh3add},
+    InstSpec{"add.uw", mask_funct7, encode(OP_OP_32, 0b000, 0b0000100), Format::R, Ext::B, Kind::ALU, alu_add_uw},
+    InstSpec{"sh1add.uw", mask_funct7, encode(OP_OP_32, 0b010, 0b0010000), Format::R, Ext::B, Kind::ALU,
+        alu_sh1add_uw},
+    InstSpec{"sh2add.uw", mask_funct7, encode(OP_OP_32, 0b100, 0b0010000), Format::R, Ext::B, Kind::ALU,
+        alu_sh2add_uw},
+    InstSpec{"sh3add.uw", mask_funct7, encode(OP_OP_32, 0b110, 0b0010000), Format::R, Ext::B, Kind::ALU,
+        alu_sh3add_uw},
+    InstSpec{"slli.uw", mask_funct6, encode(OP_OP_IMM_32, 0b001, 0b0000100), Format::I_SHIFT, Ext::B,
+        Kind::ALU_IMM, alu_slli_uw},
+
+    // Zbb
+    InstSpec{"andn", mask_funct7, encode(OP_OP, 0b111, 0b0100000), Format::R, Ext::B, Kind::ALU, alu_andn},
+    InstSpec{"orn", mask_funct7, encode(OP_OP, 0b110, 0b0100000), Format::R, Ext::B, Kind::ALU, alu_orn},
+    InstSpec{"xnor", mask_funct7, encode(OP_OP, 0b100, 0b0100000), Format::R, Ext::B, Kind::ALU, alu_xnor},
+    InstSpec{"max", mask_funct7, encode(OP_OP, 0b110, 0b0000101), Format::R, Ext::B, Kind::ALU, alu_max},
+    InstSpec{"maxu", mask_funct7, encode(OP_OP, 0b111, 0b0000101), Format::R, Ext::B, Kind::ALU, alu_maxu},
+    InstSpec{"min", mask_funct7, encode(OP_OP, 0b100, 0b0000101), Format::R, Ext::B, Kind::ALU, alu_min},
+    InstSpec{"minu", mask_funct7, encode(OP_OP, 0b101, 0b0000101), Format::R, Ext::B, Kind::ALU, alu_minu},
+    InstSpec{"rol", mask_funct7, encode(OP_OP, 0b001, 0b0110000), Format::R, Ext::B, Kind::ALU, alu_rol},
+    InstSpec{"ror", mask_funct7, encode(OP_OP, 0b101, 0b0110000), Format::R, Ext::B, Kind::ALU, alu_ror},
+    InstSpec{"rolw", mask_funct7, encode(OP_OP_32, 0b001, 0b0110000), Format::R, Ext::B, Kind::ALU, alu_rolw},
+    InstSpec{"rorw", mask_funct7, encode(OP_OP_32, 0b101, 0b0110000), Format::R, Ext::B, Kind::ALU, alu_rorw},
+    InstSpec{"rori", mask_funct6, encode(OP_OP_IMM, 0b101, 0b0110000), Format::I_SHIFT, Ext::B, Kind::ALU_IMM,
+        alu_ror},
+    InstSpec{"roriw", mask_funct7, encode(OP_OP_IMM_32, 0b101, 0b0110000), Format::I_SHIFT, Ext::B, Kind::ALU_IMM,
+        alu_rorw},
+    InstSpec{"clz", mask_funct12, encode12(OP_OP_IMM, 0b001, 0x600), Format::R_UNARY, Ext::B, Kind::ALU_IMM,
+        alu_clz},
+    InstSpec{"ctz", mask_funct12, encode12(OP_OP_IMM, 0b001, 0x601), Format::R_UNARY, Ext::B, Kind::ALU_IMM,
+        alu_ctz},
+    InstSpec{"cpop", mask_funct12, encode12(OP_OP_IMM, 0b001, 0x602), Format::R_UNARY, Ext::B, Kind::ALU_IMM,
+        alu_cpop},
+    InstSpec{"sext.b", mask_funct12, encode12(OP_OP_IMM, 0b001, 0x604), Format::R_UNARY, Ext::B, Kind::ALU_IMM,
+        alu_sext_b},
+    InstSpec{"sext.h", mask_funct12, encode12(OP_OP_IMM, 0b001, 0x605), Format::R_UNARY, Ext::B, Kind::ALU_IMM,
+        alu_sext_h},
+    InstSpec{"clzw", mask_funct12, encode12(OP_OP_IMM_32, 0b001, 0x600), Format::R_UNARY, Ext::B, Kind::ALU_IMM,
+        alu_clzw},
+    InstSpec{"ctzw", mask_funct12, encode12(OP_OP_IMM_32, 0b001, 0x601), Format::R_UNARY, Ext::B, Kind::ALU_IMM,
+        alu_ctzw},
+    InstSpec{"cpopw", mask_funct12, encode12(OP_OP_IMM_32, 0b001, 0x602), Format::R_UNARY, Ext::B, Kind::ALU_IMM,
+        alu_cpopw},
+    InstSpec{"zext.h", mask_funct12, encode12(OP_OP_32, 0b100, 0x080), Format::R_UNARY, Ext::B, Kind::ALU,
+        alu_zext_h},
+    InstSpec{"orc.b", mask_funct12, encode12(OP_OP_IMM, 0b101, 0x287), Format::R_UNARY, Ext::B, Kind::ALU_IMM,
+        alu_orc_b},
+    InstSpec{"rev8", mask_funct12, encode12(OP_OP_IMM, 0b101, 0x6b8), Format::R_UNARY, Ext::B, Kind::ALU_IMM,
+        alu_rev8},
+
+    // Zbs
+    InstSpec{"bclr", mask_funct7, encode(OP_OP, 0b001, 0b0100100), Format::R, Ext::B, Kind::ALU, alu_bclr},
+    InstSpec{"bext", mask_funct7, encode(OP_OP, 0b101, 0b0100100), Format::R, Ext::B, Kind::ALU, alu_bext},
+    InstSpec{"binv", mask_funct7, encode(OP_OP, 0b001, 0b0110100), Format::R, Ext::B, Kind::ALU, alu_binv},
+    InstSpec{"bset", mask_funct7, encode(OP_OP, 0b001, 0b0010100), Format::R, Ext::B, Kind::ALU, alu_bset},
+    InstSpec{"bclri", mask_funct6, encode(OP_OP_IMM, 0b001, 0b0100100), Format::I_SHIFT, Ext::B, Kind::ALU_IMM,
+        alu_bclr},
+    InstSpec{"bexti", mask_funct6, encode(OP_OP_IMM, 0b101, 0b0100100), Format::I_SHIFT, Ext::B, Kind::ALU_IMM,
+        alu_bext},
+    InstSpec{"binvi", mask_funct6, encode(OP_OP_IMM, 0b001, 0b0110100), Format::I_SHIFT, Ext::B, Kind::ALU_IMM,
+        alu_binv},
+    InstSpec{"bseti", mask_funct6, encode(OP_OP_IMM, 0b001, 0b0010100), Format::I_SHIFT, Ext::B, Kind::ALU_IMM,
+        alu_bset},
+};
+
+/* DECODING
+ * ========
+ * Instructions are looked up by a key made of the upper five bits of their opcode, funct3, and funct7, in a flat
+ * table built from inst_specs. Keys shared by instructions that are only told apart by rs2, like the unary Zbb
+ * ones, ECALL and EBREAK, or LR, point to a second table indexed by rs2 instead. Bits outside of those fields
+ * that only have to be zero, like ECALL's rd and rs1, aren't checked.
+ * */
+constexpr std::size_t decode_key_bits = 15;
+constexpr uint16_t decode_secondary_flag = 0x8000;
+constexpr std::size_t decode_secondary_blocks = 16;
+
+static_assert(inst_specs.size() < decode_secondary_flag);
+
+[[nodiscard]] constexpr std::size_t decode_key(uint32_t inst) {
+    return ((inst >> 2) & 0x1f) | ((inst >> 7) & 0xe0) | ((inst >> 17) & 0x7f00);
+}
+
+struct DecodeTable {
+    // Index into inst_specs, or decode_secondary_flag and a block of secondary
+    std::array<uint16_t, std::size_t{1} << decode_key_bits> primary;
+    // Blocks of 32 indices into inst_specs, one for every value of rs2
+    std::array<uint16_t, decode_secondary_blocks * 32> secondary;
+};
+
+extern const DecodeTable decode_table;
+
+// Returns the index of the instruction in inst_specs, 0 if it isn't known
+[[nodiscard]] inline std::size_t decode(uint32_t inst) {
+    // Compressed instructions aren't supported
+    if ((inst & 0b11) != 0b11)
+        return 0;
+    uint16_t entry = decode_table.primary[decode_key(inst)];
+    if (entry & decode_secondary_flag)
+        entry = decode_table.secondary[(entry & ~decode_secondary_flag) * 32 + ((inst >> 20) & 0x1f)];
+    return entry;
+}
+
+// Returns the instruction at pc in assembly, with jump and branch targets as absolute addresses
+std::string disassemble(uint32_t inst, uint64_t pc);
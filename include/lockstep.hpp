@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "cpu.hpp"
+
+/* LOCKSTEP EXECUTION
+ * ==================
+ * Runs several Cpus that execute the same program, like fuzzing or Monte Carlo runs that only differ in their
+ * inputs, as groups of up to lockstep_max_lanes lanes sharing a single pc. Each instruction is decoded once per
+ * group, and the register files are kept structure of arrays so that ALU instructions are a loop over the lanes
+ * applying the op from inst_specs, which the compiler turns into vector instructions. The loops are built for
+ * AVX-512, AVX2 and plain x86-64, picked between when the program is loaded. Loads and stores go to each lane's own
+ * memory.
+ *
+ * Everything else (ECALL, AMOs, the UART, faults) runs on each lane's Cpu with the scalar interpreter, then the
+ * lanes are compared again. A lane leaves the group when its control flow disagrees with
+ * the majority on a branch or jump, and is finished on its own with the scalar interpreter.
+ *
+ * Instructions are fetched from the memory of the first lane still in the group, so lanes must not modify
+ * their code differently.
+ * */
+constexpr std::size_t lockstep_max_lanes = 16;
+
+struct LaneOutcome {
+    // Set if the guest exited
+    std::optional<int> exit_code{};
+    // Why the lane stopped otherwise
+    std::string error{};
+    // Instructions the lane executed as part of its group, including the one it left on
+    uint64_t lockstep_retired{0};
+};
+
+// Per lane observers (tracing, statistics, cache simulation) would see instructions out of order. Cache simulation
+// and binary traces need statistics.
+constexpr bool supports_lockstep(const CpuConfig &cfg) {
+    return cfg.trace < 2 && !cfg.stats;
+}
+
+/* Runs every Cpu until it stops, in groups of up to lockstep_max_lanes, using the variant built for cfg where
+ * lanes run on their own. Lanes only start out in a group together if they start at the same pc. Throws
+ * std::runtime_error if cfg isn't supported, or if a Cpu has caches or a tracer attached or is multi_hart.
+ * */
+std::vector<LaneOutcome> run_lockstep(std::span<Cpu *const> cpus, const CpuConfig &cfg);
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+/* FILE MAPPINGS
+ * =============
+ * Host files can be mapped into the guest's address space above memory with mmap, so that guests can scan
+ * inputs far larger than memory without them being copied in first: loads read straight from the host's page
+ * cache, and pages are only read in once they're touched. Mappings are either read-only, where stores fault, or
+ * private, where stores go to copy on write pages that never reach the file.
+ *
+ * Loads, stores, AMOs, and hypercalls work on mapped ranges like on memory, but code can't be run from them.
+ * Stores to mappings don't mark pages dirty and aren't recorded in binary traces. Mappings take priority over
+ * addresses wrapping around memory in unchecked configurations. A file that shrinks while it's mapped kills
+ * the emulator with SIGBUS.
+ * */
+
+enum class MapMode {
+    READ_ONLY,
+    PRIVATE,
+};
+
+class FileMapping {
+public:
+    // Maps all of the file at path to guest addresses starting at base. Throws std::runtime_error if it can't.
+    FileMapping(const char *path, uint64_t base, MapMode mode);
+    ~FileMapping();
+
+    FileMapping(FileMapping &&other) noexcept;
+    FileMapping &operator=(FileMapping &&other) noexcept;
+    FileMapping(const FileMapping &) = delete;
+    FileMapping &operator=(const FileMapping &) = delete;
+
+    uint64_t base() const { return guest_base; }
+    // One past the last mapped guest address
+    uint64_t end() const { return guest_base + length; }
+    bool writable() const { return mode == MapMode::PRIVATE; }
+    uint8_t *data() const { return host; }
+
+    bool contains(uint64_t addr) const { return addr >= guest_base && addr - guest_base < length; }
+
+private:
+    uint8_t *host{nullptr};
+    uint64_t guest_base{0};
+    std::size_t length{0};
+    MapMode mode{MapMode::READ_ONLY};
+};
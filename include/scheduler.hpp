@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <span>
+#include <vector>
+
+#include "cpu.hpp"
+
+/* HART SCHEDULER
+ * ==============
+ * Runs many harts sharing one memory on a few host threads. Every worker thread has a Cpu of its own and runs one
+ * hart on it at a time, for a time slice of up to a quantum of instructions. Switching harts copies the register
+ * file, pc, and reservation state of the outgoing hart out of the Cpu and those of the incoming one in.
+ *
+ * Ready harts wait in one deque per worker. A worker runs the harts in its own deque round robin, taking them
+ * from the front and putting them back at the end, and once it runs dry steals from the end of the others'.
+ *
+ * A hart gives up the rest of its slice when it executes WFI, or when it comes back to an LR without having
+ * completed the SC after the previous one, as it is then spinning on a lock some other hart holds. After WFI,
+ * the hart sleeps until another hart executes an AMO or a successful SC, so harts waiting for work cost nothing
+ * while others run. Guests should wake harts with atomics: sleeping harts only see plain stores once no hart is
+ * left running, at which point they're all woken, WFI being allowed to return early.
+ *
+ * AMOs are atomic against harts running on other host threads, and SC only stores while memory still holds the
+ * value LR loaded, so LR/SC sequences are too. That compare is all that guards SC: the reservations kept for
+ * --multi-hart belong to a single Cpu and can't see stores made on other workers, so harts can't be combined
+ * with it. Naturally aligned loads and stores are relaxed atomic accesses, so they don't race with AMOs either,
+ * but misaligned ones and the memory hypercalls copy bytes and may tear when other harts write the same memory.
+ * */
+
+/* Runs `harts` harts on one host thread per Cpu, all starting at the first Cpu's pc with zeroed registers but for
+ * their hart id in x10, until every one of them exited. The other Cpus are switched over to the first one's
+ * memory, unless they were constructed on it already. run_slice is the slice entry of the CpuVariant the Cpus are
+ * configured for.
+ *
+ * Returns the exit code of every hart. Throws std::runtime_error naming the hart if one of them faults, after
+ * stopping the others at the end of their slices.
+ * */
+std::vector<int> schedule_harts(std::span<Cpu *const> cpus, step_fn run_slice, std::size_t harts, uint64_t quantum);
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+
+#include "cpu.hpp"
+
+/* SERVER PROTOCOL
+ * ===============
+ * Clients connect to a SOCK_STREAM Unix domain socket and send any number of jobs over the connection, each
+ * one a ServerRequest followed by `length` bytes of payload. Every job is answered with a ServerResponse
+ * followed by `output_length` bytes of guest UART output and `message_length` bytes of error message.
+ *
+ * All fields are in host byte order, client and server are expected to run on the same machine.
+ * */
+constexpr uint32_t server_magic = 0x4d455652; // "RVEM"
+constexpr uint64_t server_max_path = 4096;
+// Guest UART output beyond this is dropped, and only counted in ServerResponse::output_dropped
+constexpr uint64_t server_max_output = 16 * 1024 * 1024; // 16 MiB
+
+enum ServerJobKind : uint32_t {
+    // Payload is the path of a flat binary, as seen by the server
+    JOB_PATH = 0,
+    // Payload is the flat binary itself
+    JOB_IMAGE = 1,
+};
+
+enum ServerStatus : uint32_t {
+    // The guest made the exit ECALL, exit_code holds its code
+    STATUS_EXITED = 0,
+    STATUS_BUDGET_EXHAUSTED = 1,
+    // Emulation stopped on an error, see the message
+    STATUS_FAULT = 2,
+    // The job never started, see the message
+    STATUS_BAD_REQUEST = 3,
+};
+
+struct ServerRequest {
+    uint32_t magic;
+    uint32_t kind;
+    // Maximum number of instructions to execute, 0 for no limit
+    uint64_t budget;
+    uint64_t length;
+};
+
+struct ServerResponse {
+    uint32_t status;
+    int32_t exit_code;
+    uint64_t retired;
+    uint64_t branches_taken;
+    uint64_t output_length;
+    // Bytes of output left out because the job wrote more than server_max_output
+    uint64_t output_dropped;
+    uint64_t message_length;
+};
+
+/* Listens on socket_path with `workers` threads sharing a pool of `pool_size` pre-faulted Cpus. A socket already
+ * at the path is replaced, anything else there makes it fail. A Cpu is reset in the background after every job,
+ * so the pool should be large enough to cover the jobs that arrive while one reset is in progress; a job that
+ * finds none clean waits for its own reset. Only returns if the socket can't be set up or stops accepting
+ * connections.
+ *
+ * A connection keeps its worker for as long as it stays open, so there should be at least as many workers as
+ * concurrent clients.
+ * */
+int serve(const char *socket_path, unsigned workers, std::size_t pool_size, run_fn run_variant);
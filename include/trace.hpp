@@ -0,0 +1,172 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+/* BINARY TRACE FORMAT
+ * ===================
+ * A trace starts with a 16 byte header: trace_magic, then the keyframe interval as a little endian uint64.
+ * Then comes one record per retired instruction, made of a tag byte followed by the fields its bits select,
+ * in this order:
+ *
+ *   TRACE_KEYFRAME  uleb instruction index, uleb pc, x1..x31 as little endian int64s, then a uleb page count
+ *                   and that many pages, each a uleb page number followed by trace_page_size bytes. Holds the
+ *                   state right before the instruction, and is always followed by its record without TRACE_JUMP.
+ *   TRACE_JUMP      sleb pc - (previous pc + 4), only present when the instruction isn't the next one in
+ *                   sequence
+ *   TRACE_REG       register number byte, sleb value written to it
+ *   TRACE_MEM       uleb address, uleb size, then the size bytes of memory after the write
+ *
+ * uleb and sleb are the unsigned and signed LEB128 encodings used by DWARF. Keyframes are written every
+ * keyframe interval instructions starting with the first, so a reader can start at any of them. Memory is never
+ * written out in full: a keyframe only carries the pages written since the keyframe before it, in ascending order.
+ * So memory at a keyframe is the image the guest was started with plus the pages of every keyframe up to it, which
+ * a reader can rebuild without the records in between.
+ * */
+constexpr std::array<char, 8> trace_magic{'R', 'V', 'T', 'R', 'A', 'C', 'E', '3'};
+constexpr uint64_t trace_keyframe_interval = 1 << 16;
+constexpr std::size_t trace_page_size = 4096;
+
+enum TraceTag : uint8_t {
+    TRACE_JUMP = 1 << 0,
+    TRACE_REG = 1 << 1,
+    TRACE_MEM = 1 << 2,
+    TRACE_KEYFRAME = 1 << 7,
+};
+
+// Memory writes up to this size are staged with the rest of their record, bigger ones (hypercalls) are passed
+// through to the ring directly
+constexpr std::size_t trace_max_inline_mem = 64;
+// Longest staged encoding of a single record, a keyframe followed by a register and a memory write. The pages of
+// a keyframe are passed through to the ring.
+constexpr std::size_t trace_max_record = 1 + 2 * 10 + 31 * 8 + 10 + 10 + 1 + 10 + 10 + 10 + trace_max_inline_mem;
+
+inline uint8_t *put_uleb(uint8_t *out, uint64_t value) {
+    do {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        *out++ = byte | (value != 0 ? 0x80 : 0);
+    } while (value != 0);
+    return out;
+}
+
+inline uint8_t *put_sleb(uint8_t *out, int64_t value) {
+    for (;;) {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        bool done = (value == 0 && !(byte & 0x40)) || (value == -1 && (byte & 0x40));
+        *out++ = byte | (done ? 0 : 0x80);
+        if (done)
+            return out;
+    }
+}
+
+/* Streams the trace of a single hart to a file. The interpreter encodes records into a staging buffer and hands
+ * it over in chunks through a single producer, single consumer ring, which a background thread drains with
+ * write(2). When the writer falls behind, the interpreter waits for room rather than dropping records.
+ * */
+class TraceWriter {
+public:
+    // Creates or truncates path and writes the header. Throws std::runtime_error if the file can't be opened.
+    explicit TraceWriter(const char *path);
+    // Writes out everything still buffered
+    ~TraceWriter();
+
+    TraceWriter(const TraceWriter &) = delete;
+    TraceWriter &operator=(const TraceWriter &) = delete;
+
+    // Notes a write of size bytes at memory index addr by the instruction being executed
+    void mem_write(std::size_t addr, std::size_t size) {
+        pending_addr = addr;
+        pending_size = size;
+        for (auto page = addr / trace_page_size; page <= (addr + size - 1) / trace_page_size; page++) {
+            if (page >= page_written.size())
+                page_written.resize(page + 1);
+            if (!page_written[page]) {
+                page_written[page] = true;
+                written_pages.push_back(page);
+            }
+        }
+    }
+
+    // Called before the instruction at pc executes, writes a keyframe if one is due. registers and memory hold
+    // the state before the instruction.
+    void begin(uint64_t pc, const int64_t *registers, const uint8_t *memory) {
+        if (retired % trace_keyframe_interval == 0)
+            keyframe(pc, registers, memory);
+    }
+
+    // Records the instruction at pc, which wrote registers[rd] unless rd is 0, and whatever memory was passed to
+    // mem_write since begin(). registers and memory hold the state after the instruction.
+    void retire(uint64_t pc, std::size_t rd, const int64_t *registers, const uint8_t *memory) {
+        uint8_t *out = stage.get() + staged;
+        uint8_t &tag = *out++;
+        tag = 0;
+
+        if (pc != next_pc) {
+            tag |= TRACE_JUMP;
+            out = put_sleb(out, static_cast<int64_t>(pc - next_pc));
+        }
+        if (rd != 0) {
+            tag |= TRACE_REG;
+            *out++ = rd;
+            out = put_sleb(out, registers[rd]);
+        }
+        if (pending_size != 0) {
+            tag |= TRACE_MEM;
+            out = put_uleb(out, pending_addr);
+            out = put_uleb(out, pending_size);
+            if (pending_size > trace_max_inline_mem) {
+                staged = out - stage.get();
+                flush_stage();
+                push(memory + pending_addr, pending_size);
+                out = stage.get();
+            } else {
+                std::memcpy(out, memory + pending_addr, pending_size);
+                out += pending_size;
+            }
+            pending_size = 0;
+        }
+
+        next_pc = pc + 4;
+        retired++;
+        staged = out - stage.get();
+        if (staged > stage_size - trace_max_record)
+            flush_stage();
+    }
+
+private:
+    static constexpr std::size_t ring_size = 4 * 1024 * 1024; // 4 MiB
+    static constexpr std::size_t stage_size = 64 * 1024; // 64 KiB
+
+    void keyframe(uint64_t pc, const int64_t *registers, const uint8_t *memory);
+    void flush_stage();
+    void push(const uint8_t *src, std::size_t size);
+    void drain_loop();
+
+    int fd;
+    std::unique_ptr<uint8_t[]> stage{new uint8_t[stage_size]};
+    std::size_t staged{0};
+    uint64_t next_pc{0};
+    uint64_t retired{0};
+    std::size_t pending_addr{0};
+    std::size_t pending_size{0};
+    // Pages written since the last keyframe, in the order they were first written and as a bitmap
+    std::vector<std::size_t> written_pages;
+    std::vector<bool> page_written;
+
+    // Free running byte counts, head is only written by the interpreter and tail by the drain thread
+    std::unique_ptr<uint8_t[]> ring{new uint8_t[ring_size]};
+    std::atomic<std::size_t> head{0};
+    std::atomic<std::size_t> tail{0};
+    // Bumped whenever head moves or stopping is set, the drain thread sleeps on it
+    std::atomic<uint32_t> doorbell{0};
+    std::atomic<bool> stopping{false};
+    std::thread drainer;
+};
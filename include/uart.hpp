@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <deque>
+#include <string>
+
+// Same location as the UART on QEMU's virt machine, so guest code written for it works unmodified
+constexpr uint64_t uart_base = 0x10000000;
+constexpr uint64_t uart_size = 8;
+constexpr std::size_t uart_out_buf_size = 64 * 1024; // 64 KiB
+
+[[nodiscard]] constexpr bool uart_contains(uint64_t addr) {
+    return addr >= uart_base && addr < uart_base + uart_size;
+}
+
+/* 16550 compatible UART. Only the register interface is modeled: there are no interrupts, baud rate, or
+ * transmit timing, so THR is always empty and every write lands in the output buffer immediately.
+ *
+ * Output is collected host side and handed to write(2) once the buffer fills, when the guest reads from the
+ * receiver, before the emulator prints traces or register dumps, or when the UART is destroyed. Input is polled
+ * from stdin without blocking.
+ *
+ * Both ends can be detached from the host's stdio for embedding, see capture_output() and disable_input().
+ * */
+class Uart {
+public:
+    Uart();
+    ~Uart();
+
+    Uart(const Uart &) = delete;
+    Uart &operator=(const Uart &) = delete;
+
+    uint8_t read(std::size_t offset);
+    void write(std::size_t offset, uint8_t value);
+    void flush();
+    // Clears all registers and pending data, keeping where input and output are routed
+    void reset();
+
+    // Flushed output is appended to dest instead of being written to stdout, dropping whatever would grow it past
+    // limit bytes
+    void capture_output(std::string *dest, std::size_t limit = SIZE_MAX);
+    // Bytes of captured output dropped since the last reset
+    uint64_t dropped_output() const { return dropped; }
+    // The receiver behaves as if stdin were at EOF
+    void disable_input();
+
+private:
+    // Reading LSR is how guests wait for both directions, so stdin is only polled once every this many reads
+    static constexpr unsigned poll_interval = 1024;
+
+    void poll_input();
+
+    std::vector<char> out_buf;
+    std::deque<uint8_t> in_buf{};
+    unsigned polls_skipped{poll_interval};
+    bool in_eof{false};
+    bool in_disabled{false};
+    std::string *capture{nullptr};
+    std::size_t capture_limit{SIZE_MAX};
+    uint64_t dropped{0};
+
+    uint8_t ier{0};
+    uint8_t fcr{0};
+    uint8_t lcr{0};
+    uint8_t mcr{0};
+    uint8_t scr{0};
+    uint8_t dll{0};
+    uint8_t dlm{0};
+};
@@ -28,17 +28,17 @@ union dword_u {
 }
 
 [[nodiscard]] constexpr int32_t get_s_imm(uint32_t inst) {
-    uint8_t data1 = (inst >> 7) & 0b11111;
-    int8_t data2_se = (inst >> 25);
-    return static_cast<int32_t>(data2_se) << 5 | data1;
+    uint32_t data1 = (inst >> 7) & 0b11111;
+    int32_t data2_se = static_cast<int32_t>(inst & 0xfe000000) >> 20;
+    return data2_se | data1;
 }
 
 [[nodiscard]] constexpr int32_t get_b_imm(uint32_t inst) {
     uint32_t data1 = (inst >> 7) & 0b11110;
-    uint32_t data2 = ((inst >> 25) << 5);
-    uint32_t eleventh = ((inst >> 7) & 1) << 10;
-    int32_t twelth = 0u - (inst >> 31);
-    return (twelth & ~0xfff) | eleventh | data2 | data1;
+    uint32_t data2 = (inst >> 20) & 0b11111100000;
+    uint32_t eleventh = ((inst >> 7) & 1) << 11;
+    int32_t twelth = static_cast<int32_t>(inst & 0x80000000) >> 19;
+    return twelth | eleventh | data2 | data1;
 }
 
 [[nodiscard]] constexpr int32_t get_u_imm(uint32_t inst) {
@@ -47,8 +47,14 @@ union dword_u {
 
 [[nodiscard]] constexpr int32_t get_j_imm(uint32_t inst) {
     uint32_t eleventh = (inst & (1 << 20)) >> 9;
-    uint32_t twentieth = (inst & (1 << 31)) >> 11;
+    int32_t twentieth = static_cast<int32_t>(inst & 0x80000000) >> 11;
     uint32_t data1 = (inst >> 20) & 0b11111111110;
-    uint32_t data2 = (inst & (0b111111111 << 12));
+    uint32_t data2 = (inst & (0b11111111 << 12));
     return twentieth | data2 | eleventh | data1;
 }
+
+static_assert(get_s_imm(0xfe113c23) == -8);   // sd ra, -8(sp)
+static_assert(get_b_imm(0xfe0718e3) == -16);  // bnez a4, -16
+static_assert(get_b_imm(0x7e000fe3) == 4094);
+static_assert(get_j_imm(0xff1ff0ef) == -16);  // jal -16
+static_assert(get_j_imm(0x7ffff06f) == 0xffffe);
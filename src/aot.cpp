@@ -0,0 +1,376 @@
+#include <map>
+#include <optional>
+#include <utility>
+#include <vector>
+#include <string>
+#include <format>
+#include <fstream>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <sstream>
+#include <stdexcept>
+#include <filesystem>
+
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "aot.hpp"
+#include "util.hpp"
+
+// Bumped whenever the generated code changes, so stale cached modules aren't picked up
+constexpr uint64_t aot_version = 3;
+
+// Every instruction reachable from program_bgn, following both sides of branches and assuming calls return
+static std::map<uint64_t, uint32_t> discover(const uint8_t *image, std::size_t image_size) {
+    std::map<uint64_t, uint32_t> insts;
+    std::vector<uint64_t> worklist{program_bgn};
+
+    while (!worklist.empty()) {
+        uint64_t pc = worklist.back();
+        worklist.pop_back();
+
+        if (pc % 4 != 0 || pc + 4 > image_size || insts.contains(pc))
+            continue;
+
+        dword_u inst_bytes{};
+        std::memcpy(inst_bytes.bytes, image + pc, 4);
+        uint32_t inst = inst_bytes.dword;
+        if (inst == 0)
+            continue;
+        insts.emplace(pc, inst);
+
+        std::size_t rd = (inst >> 7) & 0x1f;
+        switch (inst & 0x7f) {
+        case OP_JAL: {
+            worklist.push_back(pc + get_j_imm(inst));
+            if (rd != 0)
+                worklist.push_back(pc + 4);
+            break;
+        }
+        case OP_JALR: {
+            if (rd != 0)
+                worklist.push_back(pc + 4);
+            break;
+        }
+        case OP_BRANCH: {
+            worklist.push_back(pc + get_b_imm(inst));
+            worklist.push_back(pc + 4);
+            break;
+        }
+        default:
+            worklist.push_back(pc + 4);
+        }
+    }
+
+    return insts;
+}
+
+/* The C++ the generated code computes op with, given the expressions for its operands as {0} and {1}. Division and
+ * bitmanip are left to the interpreter and return nullptr.
+ * */
+static const char *alu_expr(alu_fn op) {
+    const std::pair<alu_fn, const char *> exprs[] = {
+        {alu_add, "(int64_t)((uint64_t){0} + (uint64_t){1})"},
+        {alu_sub, "(int64_t)((uint64_t){0} - (uint64_t){1})"},
+        {alu_sll, "(int64_t)((uint64_t){0} << ({1} & 0x3f))"},
+        {alu_srl, "(int64_t)((uint64_t){0} >> ({1} & 0x3f))"},
+        {alu_sra, "{0} >> ({1} & 0x3f)"},
+        {alu_slt, "{0} < {1}"},
+        {alu_sltu, "(uint64_t){0} < (uint64_t){1}"},
+        {alu_xor, "{0} ^ {1}"},
+        {alu_or, "{0} | {1}"},
+        {alu_and, "{0} & {1}"},
+        {alu_addw, "(int32_t)((uint32_t){0} + (uint32_t){1})"},
+        {alu_subw, "(int32_t)((uint32_t){0} - (uint32_t){1})"},
+        {alu_sllw, "(int32_t)((uint32_t){0} << ({1} & 0x1f))"},
+        {alu_srlw, "(int32_t)((uint32_t){0} >> ({1} & 0x1f))"},
+        {alu_sraw, "(int32_t){0} >> ({1} & 0x1f)"},
+        {alu_eq, "{0} == {1}"},
+        {alu_ne, "{0} != {1}"},
+        {alu_sge, "{0} >= {1}"},
+        {alu_sgeu, "(uint64_t){0} >= (uint64_t){1}"},
+        {alu_mul, "(int64_t)((uint64_t){0} * (uint64_t){1})"},
+        {alu_mulh, "(int64_t)(((__int128){0} * (__int128){1}) >> 64)"},
+        {alu_mulhsu, "(int64_t)(((__int128){0} * (__int128)(uint64_t){1}) >> 64)"},
+        {alu_mulhu, "(int64_t)(((unsigned __int128)(uint64_t){0} * (uint64_t){1}) >> 64)"},
+        {alu_mulw, "(int32_t)((uint32_t){0} * (uint32_t){1})"},
+    };
+    for (const auto &[fn, expr] : exprs) {
+        if (fn == op)
+            return expr;
+    }
+    return nullptr;
+}
+
+// Lowers a single instruction, returning false if it's left to the interpreter
+static bool lower(std::string &out, uint64_t pc, uint32_t inst, const CpuConfig &cfg,
+        const std::map<uint64_t, uint32_t> &insts) {
+    const InstSpec &spec = inst_specs[decode(inst)];
+    if (!has_ext(cfg, spec.ext))
+        return false;
+
+    std::size_t rd = (inst >> 7) & 0x1f;
+    std::string rs1 = std::format("x{}", (inst >> 15) & 0x1f);
+    std::string rs2 = std::format("x{}", (inst >> 20) & 0x1f);
+
+    auto jump = [&](uint64_t target) {
+        if (insts.contains(target))
+            return std::format("goto i_{:x};", target);
+        return std::format("{{ pc = 0x{:x}; goto out; }}", target);
+    };
+    auto assign = [&](std::string expr) {
+        if (rd != 0)
+            out += std::format("    x{} = {};\n", rd, expr);
+    };
+    // op applied to rs1 and b, or nullopt if it isn't lowered
+    auto apply = [&](const std::string &b) -> std::optional<std::string> {
+        const char *expr = alu_expr(spec.op);
+        if (expr == nullptr)
+            return std::nullopt;
+        return std::vformat(expr, std::make_format_args(rs1, b));
+    };
+
+    switch (spec.kind) {
+    case Kind::LUI: {
+        assign(std::format("{}ll", get_u_imm(inst)));
+        return true;
+    }
+    case Kind::AUIPC: {
+        assign(std::format("{}ll", static_cast<int64_t>(pc) + get_u_imm(inst)));
+        return true;
+    }
+    case Kind::JAL: {
+        assign(std::format("{}ll", pc + 4));
+        out += std::format("    {}\n", jump(pc + get_j_imm(inst)));
+        return true;
+    }
+    case Kind::JALR: {
+        out += std::format("    {{ uint64_t target = ((uint64_t){} + {}ull) & ~1ull;", rs1,
+                static_cast<uint64_t>(get_i_imm(inst)));
+        if (rd != 0)
+            out += std::format(" x{} = {}ll;", rd, pc + 4);
+        out += " pc = target; goto dispatch; }\n";
+        return true;
+    }
+    case Kind::BRANCH: {
+        auto cond = apply(rs2);
+        if (!cond)
+            return false;
+        out += std::format("    if ({}) {}\n", *cond, jump(pc + get_b_imm(inst)));
+        return true;
+    }
+    case Kind::ALU:
+    case Kind::ALU_IMM: {
+        auto expr = apply(spec.kind == Kind::ALU ? rs2 : std::format("{}ll", get_i_imm(inst)));
+        if (!expr)
+            return false;
+        assign(*expr);
+        return true;
+    }
+    case Kind::LOAD: {
+        // Anything outside of memory, the UART included, goes through the interpreter
+        out += std::format("    {{ uint64_t addr = (uint64_t){} + {}ull;"
+                " if (addr > {}ull) {{ pc = 0x{:x}; goto out; }}",
+                rs1, static_cast<uint64_t>(get_i_imm(inst)), mem_size - spec.size, pc);
+        if (rd != 0)
+            out += std::format(" {}int{}_t val; std::memcpy(&val, mem + addr, {}); x{} = val;",
+                    spec.is_signed ? "" : "u", 8 * spec.size, spec.size, rd);
+        out += " }\n";
+        return true;
+    }
+    case Kind::STORE: {
+        out += std::format("    {{ uint64_t addr = (uint64_t){} + {}ull;"
+                " if (addr > {}ull) {{ pc = 0x{:x}; goto out; }}"
+                " uint{}_t val = {}; std::memcpy(mem + addr, &val, {}); }}\n",
+                rs1, static_cast<uint64_t>(get_s_imm(inst)), mem_size - spec.size, pc, 8 * spec.size, rs2,
+                spec.size);
+        return true;
+    }
+    case Kind::FENCE:
+        // A noop for the interpreter too
+        return true;
+    default:
+        return false;
+    }
+}
+
+std::string translate_image(const uint8_t *image, std::size_t image_size, const CpuConfig &cfg) {
+    auto insts = discover(image, image_size);
+
+    std::string out = "#include <cstdint>\n#include <cstring>\n\n"
+        "extern \"C\" uint64_t aot_entry(int64_t *regs, uint8_t *mem, uint64_t pc) {\n"
+        "    constexpr int64_t x0 = 0;\n";
+    for (std::size_t i = 1; i < 32; i++)
+        out += std::format("    int64_t x{0} = regs[{0}];\n", i);
+
+    out += "dispatch:\n    switch (pc) {\n";
+    for (const auto &[pc, inst] : insts)
+        out += std::format("    case 0x{0:x}: goto i_{0:x};\n", pc);
+    out += "    default: goto out;\n    }\n";
+
+    for (auto it = insts.begin(); it != insts.end(); it++) {
+        auto [pc, inst] = *it;
+        out += std::format("i_{:x}:\n", pc);
+
+        if (!lower(out, pc, inst, cfg, insts)) {
+            out += std::format("    pc = 0x{:x}; goto out;\n", pc);
+            continue;
+        }
+
+        Kind kind = inst_specs[decode(inst)].kind;
+        if (kind == Kind::JAL || kind == Kind::JALR)
+            continue;
+
+        // Falls through unless the next instruction isn't the one emitted next
+        auto next = std::next(it);
+        if (next == insts.end() || next->first != pc + 4) {
+            if (insts.contains(pc + 4))
+                out += std::format("    goto i_{:x};\n", pc + 4);
+            else
+                out += std::format("    pc = 0x{:x}; goto out;\n", pc + 4);
+        }
+    }
+
+    out += "out:\n";
+    for (std::size_t i = 1; i < 32; i++)
+        out += std::format("    regs[{0}] = x{0};\n", i);
+    out += "    (void)x0;\n    return pc;\n}\n";
+
+    return out;
+}
+
+/* The module cache, created private to the user if it doesn't exist yet. Whatever is found in it is loaded into the
+ * process, so a directory anybody else owns or can write to is refused rather than used.
+ * */
+static std::filesystem::path cache_dir() {
+    std::filesystem::path dir;
+    if (const char *xdg = std::getenv("XDG_CACHE_HOME"); xdg != nullptr && *xdg != '\0')
+        dir = std::filesystem::path{xdg} / "riscv-emu";
+    else if (const char *home = std::getenv("HOME"); home != nullptr && *home != '\0')
+        dir = std::filesystem::path{home} / ".cache" / "riscv-emu";
+    else
+        throw std::runtime_error("neither XDG_CACHE_HOME nor HOME is set, there's nowhere to cache modules");
+
+    std::filesystem::create_directories(dir.parent_path());
+    if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST)
+        throw std::runtime_error(std::format("error while creating {}: {}", dir.string(), strerror(errno)));
+
+    struct stat st{};
+    if (lstat(dir.c_str(), &st) != 0)
+        throw std::runtime_error(std::format("error while checking {}: {}", dir.string(), strerror(errno)));
+    if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0)
+        throw std::runtime_error(std::format("{} isn't a directory only the user can write to, refusing to load "
+                "modules from it", dir.string()));
+    return dir;
+}
+
+// Compiles src into the shared object out with $CXX, split at spaces, or c++. Throws std::runtime_error if it fails.
+static void compile(const std::filesystem::path &src, const std::filesystem::path &out) {
+    std::vector<std::string> args;
+    const char *cxx = std::getenv("CXX");
+    std::istringstream words{cxx != nullptr ? cxx : ""};
+    for (std::string word; words >> word;)
+        args.push_back(word);
+    if (args.empty())
+        args.emplace_back("c++");
+    for (const char *arg : {"-std=c++17", "-O2", "-shared", "-fPIC", "-o"})
+        args.emplace_back(arg);
+    args.push_back(out.string());
+    args.push_back(src.string());
+
+    std::vector<char *> argv;
+    for (auto &arg : args)
+        argv.push_back(arg.data());
+    argv.push_back(nullptr);
+
+    pid_t pid = fork();
+    if (pid < 0)
+        throw std::runtime_error(std::format("error while starting the host compiler: {}", strerror(errno)));
+    if (pid == 0) {
+        execvp(argv[0], argv.data());
+        _exit(127);
+    }
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR)
+            throw std::runtime_error(std::format("error while waiting for the host compiler: {}", strerror(errno)));
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        std::string cmd;
+        for (const auto &arg : args)
+            cmd += (cmd.empty() ? "" : " ") + arg;
+        throw std::runtime_error(std::format("host compiler failed: {}", cmd));
+    }
+}
+
+// FNV-1a over everything the generated code depends on
+static uint64_t module_key(const uint8_t *image, std::size_t image_size, const CpuConfig &cfg) {
+    uint64_t hash = 0xcbf29ce484222325;
+    auto mix = [&hash](uint64_t byte) {
+        hash ^= byte;
+        hash *= 0x100000001b3;
+    };
+
+    for (std::size_t i = 0; i < image_size; i++)
+        mix(image[i]);
+    mix(image_size);
+    mix(cfg.ext_m);
+    mix(mem_size);
+    mix(aot_version);
+    return hash;
+}
+
+AotModule::AotModule(const Cpu &cpu, std::size_t image_size, const CpuConfig &cfg) {
+    const uint8_t *image = cpu.memory->data() + program_bgn;
+    auto dir = cache_dir();
+    auto so_path = dir / std::format("{:016x}.so", module_key(image, image_size, cfg));
+
+    if (!std::filesystem::exists(so_path)) {
+        // Built under names of our own and renamed into place, concurrent runs of the same image can race
+        auto src_path = dir / std::format("{}.{}.cpp", so_path.stem().string(), getpid());
+        auto tmp_path = dir / std::format("{}.{}.so", so_path.stem().string(), getpid());
+        {
+            std::ofstream src{src_path};
+            src << translate_image(image, image_size, cfg);
+            if (!src)
+                throw std::runtime_error(std::format("error while writing {}", src_path.string()));
+        }
+
+        try {
+            compile(src_path, tmp_path);
+        } catch (...) {
+            std::filesystem::remove(src_path);
+            std::filesystem::remove(tmp_path);
+            throw;
+        }
+        std::filesystem::remove(src_path);
+
+        std::filesystem::rename(tmp_path, so_path);
+    }
+
+    handle = dlopen(so_path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (handle == nullptr)
+        throw std::runtime_error(std::format("error while loading {}: {}", so_path.string(), dlerror()));
+
+    entry = reinterpret_cast<entry_fn>(dlsym(handle, "aot_entry"));
+    if (entry == nullptr) {
+        dlclose(handle);
+        throw std::runtime_error(std::format("{} has no aot_entry", so_path.string()));
+    }
+}
+
+AotModule::~AotModule() {
+    dlclose(handle);
+}
+
+int AotModule::run(Cpu &cpu, step_fn step) const {
+    for (;;) {
+        cpu.pc = entry(cpu.registers.data(), cpu.memory->data(), cpu.pc);
+        if (auto rc = step(cpu))
+            return *rc;
+    }
+}
@@ -0,0 +1,167 @@
+#include <algorithm>
+#include <bit>
+#include <charconv>
+#include <cstring>
+#include <format>
+#include <stdexcept>
+
+#include "cache.hpp"
+#include "isa.hpp"
+
+std::optional<CacheLevelConfig> parse_cache_level(std::string_view spec) {
+    std::vector<std::string_view> fields;
+    for (std::size_t start = 0, end; start <= spec.size(); start = end + 1) {
+        end = std::min(spec.find(':', start), spec.size());
+        fields.push_back(spec.substr(start, end - start));
+    }
+
+    if (fields.size() != 3 && fields.size() != 4)
+        return std::nullopt;
+
+    auto parse_num = [](std::string_view field, std::size_t &out) {
+        std::size_t scale = 1;
+        if (!field.empty() && (field.back() == 'k' || field.back() == 'K')) {
+            scale = 1024;
+            field.remove_suffix(1);
+        } else if (!field.empty() && (field.back() == 'm' || field.back() == 'M')) {
+            scale = 1024 * 1024;
+            field.remove_suffix(1);
+        }
+        auto res = std::from_chars(field.data(), field.data() + field.size(), out);
+        out *= scale;
+        return res.ec == std::errc{} && res.ptr == field.data() + field.size() && out != 0;
+    };
+
+    CacheLevelConfig cfg{};
+    if (!parse_num(fields[0], cfg.size) || !parse_num(fields[1], cfg.ways) || !parse_num(fields[2], cfg.line_size))
+        return std::nullopt;
+
+    if (fields.size() == 4) {
+        if (fields[3] == "lru")
+            cfg.policy = ReplacementPolicy::LRU;
+        else if (fields[3] == "fifo")
+            cfg.policy = ReplacementPolicy::FIFO;
+        else if (fields[3] == "random")
+            cfg.policy = ReplacementPolicy::RANDOM;
+        else
+            return std::nullopt;
+    }
+
+    return cfg;
+}
+
+CacheLevel::CacheLevel(const CacheLevelConfig &cfg) : cfg{cfg}, sets{0} {
+    if (!std::has_single_bit(cfg.line_size) || cfg.ways == 0 || cfg.size % (cfg.ways * cfg.line_size) != 0)
+        throw std::runtime_error(std::format("invalid cache geometry: {} bytes, {} ways, {} byte lines",
+                    cfg.size, cfg.ways, cfg.line_size));
+
+    sets = cfg.size / (cfg.ways * cfg.line_size);
+    if (!std::has_single_bit(sets))
+        throw std::runtime_error(std::format("cache set count is not a power of two: {}", sets));
+
+    lines.resize(sets * cfg.ways);
+}
+
+bool CacheLevel::access(uint64_t addr, bool write) {
+    uint64_t line = addr / cfg.line_size;
+    uint64_t tag = line / sets;
+    Way *set = &lines[(line % sets) * cfg.ways];
+    clock++;
+
+    for (std::size_t i = 0; i < cfg.ways; i++) {
+        if (set[i].valid && set[i].tag == tag) {
+            hits++;
+            if (cfg.policy == ReplacementPolicy::LRU)
+                set[i].stamp = clock;
+            set[i].dirty |= write;
+            return true;
+        }
+    }
+
+    misses++;
+
+    Way *victim = std::find_if(set, set + cfg.ways, [](const Way &way) { return !way.valid; });
+    if (victim == set + cfg.ways) {
+        switch (cfg.policy) {
+        case ReplacementPolicy::LRU:
+        case ReplacementPolicy::FIFO: {
+            victim = std::min_element(set, set + cfg.ways,
+                    [](const Way &a, const Way &b) { return a.stamp < b.stamp; });
+            break;
+        }
+        case ReplacementPolicy::RANDOM: {
+            // xorshift64
+            rng_state ^= rng_state << 13;
+            rng_state ^= rng_state >> 7;
+            rng_state ^= rng_state << 17;
+            victim = &set[rng_state % cfg.ways];
+            break;
+        }
+        }
+    }
+
+    if (victim->valid && victim->dirty)
+        writebacks++;
+
+    *victim = Way {.tag = tag, .stamp = clock, .valid = true, .dirty = write};
+    return false;
+}
+
+CacheHierarchy::CacheHierarchy(const CacheLevelConfig &l1i_cfg, const CacheLevelConfig &l1d_cfg,
+        const CacheLevelConfig &l2_cfg)
+    : l1i{l1i_cfg}, l1d{l1d_cfg}, l2{l2_cfg} {}
+
+void CacheHierarchy::fetch(uint64_t pc) {
+    if (l1i.access(pc, false))
+        return;
+
+    auto &misses = per_pc[pc];
+    misses.l1i++;
+    if (!l2.access(pc, false))
+        misses.l2++;
+}
+
+void CacheHierarchy::data(uint64_t pc, uint64_t addr, std::size_t size, bool write) {
+    // Unaligned accesses may straddle lines, each one is an access of its own
+    uint64_t line_mask = ~static_cast<uint64_t>(l1d.line_size() - 1);
+    for (uint64_t line = addr & line_mask; line < addr + size; line += l1d.line_size()) {
+        if (l1d.access(line, write))
+            continue;
+
+        auto &misses = per_pc[pc];
+        misses.l1d++;
+        if (!l2.access(line, false))
+            misses.l2++;
+    }
+}
+
+void CacheHierarchy::report(std::ostream &os, std::size_t top, std::span<const uint8_t> code) const {
+    auto level = [&os](std::string_view name, const CacheLevel &cache) {
+        uint64_t accesses = cache.hits + cache.misses;
+        double rate = accesses == 0 ? 0.0 : 100.0 * cache.misses / accesses;
+        os << std::format("{}:\taccesses: {}\tmisses: {} ({:.2f}%)\twritebacks: {}\n",
+                name, accesses, cache.misses, rate, cache.writebacks);
+    };
+    level("L1I", l1i);
+    level("L1D", l1d);
+    level("L2", l2);
+
+    std::vector<std::pair<uint64_t, PcMisses>> sorted(per_pc.begin(), per_pc.end());
+    auto total = [](const PcMisses &m) { return m.l1i + m.l1d + m.l2; };
+    std::sort(sorted.begin(), sorted.end(),
+            [&total](const auto &a, const auto &b) { return total(a.second) > total(b.second); });
+
+    if (sorted.size() > top)
+        sorted.resize(top);
+
+    os << "pc\t\tL1I misses\tL1D misses\tL2 misses\tinstruction\n";
+    for (const auto &[pc, misses] : sorted) {
+        std::string inst;
+        if (pc < code.size() && code.size() - pc >= 4) {
+            uint32_t word;
+            std::memcpy(&word, code.data() + pc, 4);
+            inst = disassemble(word, pc);
+        }
+        os << std::format("0x{:08x}\t{}\t\t{}\t\t{}\t\t{}\n", pc, misses.l1i, misses.l1d, misses.l2, inst);
+    }
+}
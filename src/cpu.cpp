@@ -4,6 +4,13 @@
 #include <iostream>
 #include <algorithm>
 #include <stdexcept>
+#include <bit>
+#include <cstring>
+#include <format>
+#include <utility>
+#include <numeric>
+#include <atomic>
+#include <type_traits>
 
 #include "cpu.hpp"
 #include "util.hpp"
@@ -13,6 +20,7 @@
  * - RV64I Base Integer Instruction Set
  * - M Standard Extension for Integer Multiplication and Division
  * - A Standard Extension for Atomic Instructions
+ * - Zba, Zbb, and Zbs Bit-Manipulation Extensions
  * TODO: Implement Zicsr, F, and G extensions, as well as the privledged instruction set.
  * */
 
@@ -39,510 +47,381 @@ std::optional<std::size_t> Cpu::invalidate(std::size_t addr) {
 }
 
 void Cpu::dump_regs() {
+    uart.flush();
     for (std::size_t i = 0; i < registers.size(); i += 2)
         std::cout << std::format("x{}:\t0x{:016x}\tx{}:\t0x{:016x}\n", 
                 i, static_cast<uint64_t>(registers[i]), 
                 i + 1, static_cast<uint64_t>(registers[i + 1]));
 }
 
-void handle_op_im(uint32_t inst, Cpu &cpu) {
-    enum funct3 {
-        ADDI = 0b000,
-        SLTI = 0b010,
-        SLTIU = 0b011,
-        XORI = 0b100,
-        ORI = 0b110,
-        ANDI = 0b111,
-        SLLI = 0b001,
-        SR = 0b101,
-    };
-
-    int64_t imm = get_i_imm(inst);
-    
-    uint8_t funct3 = (inst >> 12) & 0b111;
-    std::size_t rd = (inst >> 7) & 0x1f;
-    std::size_t rs1 = (inst >> 15) & 0x1f;
-    uint8_t shamt = (inst >> 20) & 0x3f;
-
-    if (rd == 0)
-        return;
+void Cpu::reset() {
+    registers.fill(0);
+    pc = program_bgn;
 
-    switch (funct3) {
-    case ADDI: {
-        cpu.registers[rd] = imm + cpu.registers[rs1];
-        break;
-    }
-    case SLTI: {
-        cpu.registers[rd] = cpu.registers[rs1] < imm ? 1 : 0;
-        break;
-    }
-    case SLTIU: {
-        cpu.registers[rd] = static_cast<uint64_t>(cpu.registers[rs1]) < static_cast<uint64_t>(imm) ? 1 : 0;
-        break;
-    }
-    case XORI: {
-        cpu.registers[rd] = cpu.registers[rs1] ^ imm;
-        break;
-    }
-    case ORI: {
-        cpu.registers[rd] = cpu.registers[rs1] | imm;
-        break;
-    }
-    case ANDI: {
-        cpu.registers[rd] = cpu.registers[rs1] & imm;
-        break;
-    }
-    case SLLI: {
-        cpu.registers[rd] = cpu.registers[rs1] << shamt;
-        break;
-    }
-    case SR: {
-        if (((imm >> 30) & 1) == 0)
-            // SRLI
-            cpu.registers[rd] = static_cast<uint64_t>(cpu.registers[rs1]) >> shamt;
-        else
-            // SRAI
-            cpu.registers[rd] = cpu.registers[rs1] >> shamt;
-        break;
-    }
+    if (all_dirty) {
+        memory->fill(0);
+    } else {
+        for (std::size_t page = 0; page < dirty_pages.size(); page++) {
+            if (dirty_pages.test(page))
+                std::fill_n(memory->begin() + page * page_size, page_size, 0);
+        }
     }
+    dirty_pages.reset();
+    all_dirty = false;
+    reservations.clear();
+    contexts.assign(1, HartContext {});
+    uart.reset();
+    stats = CpuStats {};
+    if (idioms)
+        idioms->clear();
+    mappings.clear();
+    budget = UINT64_MAX;
+    cur_hart = 0;
+    slice = 0;
+    waiting = false;
+    wake_events = 0;
 }
 
-void handle_op_im_32(uint32_t inst, Cpu &cpu) {
-    enum funct3 {
-        ADDIW = 0b000,
-        SLLIW = 0b001,
-        SR = 0b101,
-    };
-
-    int64_t imm = get_i_imm(inst);
-    
-    uint8_t funct3 = (inst >> 12) & 0b111;
-    std::size_t rd = (inst >> 7) & 0x1f;
-    std::size_t rs1 = (inst >> 15) & 0x1f;
-    uint8_t shamt = (inst >> 20) & 0x1f;
+void Cpu::map_file(const char *path, uint64_t base, MapMode mode) {
+    if (base % page_size != 0 || base < mem_size)
+        throw std::runtime_error(std::format("can't map {} at 0x{:x}: the address must be page aligned and lie "
+                    "above memory (0x{:x})", path, base, mem_size));
+
+    FileMapping mapping{path, base, mode};
+    if (mapping.end() < base)
+        throw std::runtime_error(std::format("can't map {} at 0x{:x}: it runs past the end of the address space",
+                    path, base));
+    if (base < uart_base + uart_size && uart_base < mapping.end())
+        throw std::runtime_error(std::format("can't map {} at 0x{:x}: it overlaps the UART at 0x{:x}",
+                    path, base, uart_base));
+    for (const auto &other : mappings) {
+        if (base < other.end() && other.base() < mapping.end())
+            throw std::runtime_error(std::format("can't map {} at 0x{:x}: it overlaps the mapping at 0x{:x}",
+                        path, base, other.base()));
+    }
+    mappings.push_back(std::move(mapping));
+}
 
-    switch (funct3) {
-    case ADDIW: {
-        cpu.registers[rd] = static_cast<int32_t>(cpu.registers[rs1]) + imm;
-        break;
-    }
-    case SLLIW: {
-        cpu.registers[rd] = static_cast<int32_t>(cpu.registers[rs1]) << shamt;
-        break;
-    }
-    case SR: {
-        if (((imm > 30) & 1) == 0)
-            // SRLIW
-            cpu.registers[rd] = static_cast<uint32_t>(cpu.registers[rs1]) >> shamt;
-        else
-            // SRAIW
-            cpu.registers[rd] = static_cast<int32_t>(cpu.registers[rs1]) >> shamt;
-        break;
-    }
+const FileMapping *Cpu::mapping_at(uint64_t addr) const {
+    for (const auto &mapping : mappings) {
+        if (mapping.contains(addr))
+            return &mapping;
     }
+    return nullptr;
 }
 
-void handle_op_op(uint32_t inst, Cpu &cpu) {
-    enum funct {
-        ADD = 0b0000000000,
-        SUB = 0b0100000000,
-
-        SLL =  0b001,
-        SLT =  0b010,
-        SLTU = 0b011,
-        XOR =  0b100,
+uint8_t *Cpu::lookup_mapping(uint64_t addr, std::size_t size, bool write) {
+    auto mapping = mapping_at(addr);
+    if (mapping == nullptr)
+        return nullptr;
+    if (mapping->end() - addr < size)
+        throw std::runtime_error(std::format("access runs past the end of a mapped file: 0x{:x} ({} bytes)",
+                    addr, size));
+    if (write && !mapping->writable())
+        throw std::runtime_error(std::format("store to a read-only mapped file: 0x{:x}", addr));
+    return mapping->data() + (addr - mapping->base());
+}
 
-        SRL = 0b0000000101,
-        SRA = 0b0100000101,
+CpuStats &CpuStats::operator+=(const CpuStats &other) {
+    retired += other.retired;
+    branches_taken += other.branches_taken;
+    for (std::size_t id = 0; id < insts.size(); id++)
+        insts[id] += other.insts[id];
+    return *this;
+}
 
-        OR =  0b110,
-        AND = 0b111,
+void CpuStats::dump(std::ostream &os) const {
+    os << std::format("retired: {}\tbranches taken: {}\n", retired, branches_taken);
+    // Most executed first
+    std::array<std::size_t, inst_specs.size()> ids;
+    std::iota(ids.begin(), ids.end(), 0);
+    std::stable_sort(ids.begin(), ids.end(), [this](std::size_t a, std::size_t b) { return insts[a] > insts[b]; });
+    for (auto id : ids) {
+        if (insts[id] != 0)
+            os << std::format("{}:\t{}\n", inst_specs[id].name, insts[id]);
+    }
+}
 
-        MUL =    0b0000001000,
-        MULH =   0b0000001001,
-        MULHSU = 0b0000001010,
-        MULHU =  0b0000001011,
+// Turns a guest address into an index into memory. Checked configurations fault on accesses that don't fit
+// entirely in memory, unchecked ones wrap around like the hardware address bus would.
+template<CpuConfig cfg>
+std::size_t translate(uint64_t addr, std::size_t size) {
+    if constexpr (cfg.checked_mem) {
+        if (addr >= mem_size || mem_size - addr < size)
+            throw std::runtime_error(std::format("memory access out of bounds: 0x{:x} ({} bytes)", addr, size));
+        return addr;
+    } else {
+        return addr % mem_size;
+    }
+}
 
-        DIV =    0b0000001100,
-        DIVU =   0b0000001101,
-        REM =    0b0000001110,
-        REMU =   0b0000001111,
-    };
+template<std::size_t size>
+using uint_of_size = std::conditional_t<size == 1, uint8_t, std::conditional_t<size == 2, uint16_t,
+        std::conditional_t<size == 4, uint32_t, uint64_t>>>;
 
-    uint16_t funct = ((inst >> 12) & 0b111) | ((inst >> 22) & 0b1111111000);
-    std::size_t rd = (inst >> 7) & 0x1f;
-    int64_t rs1 = cpu.registers[(inst >> 15) & 0x1f];
-    int64_t rs2 = cpu.registers[(inst >> 20) & 0x1f];
+/* Harts on other host threads may access the same memory with AMOs, see scheduler.hpp, so naturally aligned loads
+ * and stores are relaxed atomic accesses, which are plain moves on the usual hosts. Misaligned ones are copied
+ * bytewise and may tear.
+ * */
+template<std::size_t size>
+uint64_t load_shared(const uint8_t *src) {
+    using T = uint_of_size<size>;
+    T value;
+    if (reinterpret_cast<uintptr_t>(src) % size == 0)
+        value = std::atomic_ref<T>{*(T *)src}.load(std::memory_order_relaxed);
+    else
+        std::memcpy(&value, src, size);
+    return value;
+}
 
-    if (rd == 0)
-        return;
+template<std::size_t size>
+void store_shared(uint8_t *dst, uint64_t value) {
+    using T = uint_of_size<size>;
+    if (reinterpret_cast<uintptr_t>(dst) % size == 0) {
+        std::atomic_ref<T>{*(T *)dst}.store(static_cast<T>(value), std::memory_order_relaxed);
+    } else {
+        T narrowed = static_cast<T>(value);
+        std::memcpy(dst, &narrowed, size);
+    }
+}
 
-    __uint128_t res;
-    __int128_t res_s;
+/* Runs every iteration left of the loop whose branch at pc was just taken back to head, if it is a copy or fill
+ * idiom. Registers and memory are left as interpreting it would, with pc still on the branch. Returns false and
+ * changes nothing if the loop isn't an idiom or can't be done in bulk this time around, like when it runs
+ * outside of memory or over the instruction budget.
+ * */
+template<CpuConfig cfg>
+bool run_loop_idiom(Cpu &cpu, uint64_t head) {
+    uint8_t *memory = cpu.memory->data();
+
+    auto it = cpu.idioms->find(cpu.pc);
+    if (it == cpu.idioms->end() || it->second.head != head || (it->second.kind != IdiomKind::NONE
+                && std::memcmp(it->second.body.data(), memory + head, cpu.pc + 4 - head) != 0))
+        it = cpu.idioms->insert_or_assign(cpu.pc, match_loop_idiom(memory, head, cpu.pc)).first;
+
+    const LoopIdiom &idiom = it->second;
+    if (idiom.kind == IdiomKind::NONE)
+        return false;
+
+    uint64_t iters = loop_idiom_trip_count(idiom, cpu.registers.data());
+    uint64_t insts = iters * idiom.body.size();
+    if (iters == 0 || iters > mem_size || cpu.budget < insts)
+        return false;
+
+    uint64_t bytes = iters * idiom.width;
+    uint64_t dst = cpu.registers[idiom.dst_reg] + idiom.dst_offset;
+    auto in_memory = [bytes](uint64_t addr) { return addr < mem_size && mem_size - addr >= bytes; };
+    if (!in_memory(dst))
+        return false;
+
+    switch (idiom.kind) {
+    case IdiomKind::COPY: {
+        uint64_t src = cpu.registers[idiom.src_reg] + idiom.src_offset;
+        // Copying forwards one element at a time only agrees with memmove unless the destination overlaps the
+        // source from above
+        if (!in_memory(src) || (dst > src && dst - src < bytes))
+            return false;
+
+        // Loaded by the last iteration, before the copy gets a chance to overwrite it
+        uint64_t last = 0;
+        std::memcpy(&last, memory + src + bytes - idiom.width, idiom.width);
+        if (idiom.load_signed && idiom.width < 8) {
+            unsigned shift = 64 - 8 * idiom.width;
+            last = static_cast<int64_t>(last << shift) >> shift;
+        }
 
-    switch (funct) {
-    case ADD: {
-        cpu.registers[rd] = rs1 + rs2;
-        break;
-    }
-    case SUB: {
-        cpu.registers[rd] = rs1 - rs2;
+        std::memmove(memory + dst, memory + src, bytes);
+        cpu.registers[idiom.value_reg] = last;
         break;
     }
-    case SLT: {
-        cpu.registers[rd] = rs1 < rs2 ? 1 : 0;
+    case IdiomKind::FILL: {
+        uint64_t value = cpu.registers[idiom.value_reg];
+        std::memcpy(memory + dst, &value, idiom.width);
+        // Doubling what's filled so far keeps every copy large
+        for (uint64_t done = idiom.width; done < bytes; done *= 2)
+            std::memcpy(memory + dst + done, memory + dst, std::min(done, bytes - done));
         break;
     }
-    case SLTU: {
-        cpu.registers[rd] = 
-            static_cast<uint64_t>(rs1) < static_cast<uint64_t>(rs2) ? 1 : 0;
+    case IdiomKind::NONE:
         break;
     }
-    case AND: {
-        cpu.registers[rd] = rs1 & rs2;
-        break;
-    }
-    case OR: {
-        cpu.registers[rd] = rs1 | rs2;
-        break;
-    }
-    case XOR: {
-        cpu.registers[rd] = rs1 ^ rs2;
-        break;
-    }
-    case SLL: {
-        cpu.registers[rd] = rs1 << (rs2 & 0x3f);
-        break;
-    }
-    case SRL: {
-        cpu.registers[rd] = static_cast<uint64_t>(rs1) >> (rs2 & 0x3f);
-        break;
-    }
-    case SRA: {
-        cpu.registers[rd] = rs1 >> (rs2 & 0x3f);
-        break;
-    }
-    case MUL: {
-        cpu.registers[rd] = rs1 * rs2;
-        break;
-    }
-    case MULH: {
-        res_s = static_cast<__int128_t>(rs1) * static_cast<__int128_t>(rs2);
-        cpu.registers[rd] = res_s >> 64;
-        break;
-    }
-    case MULHU: {
-        // Double casting so we dont get sign extended to 128 bits
-        res = static_cast<__uint128_t>(static_cast<uint64_t>(rs1)) *
-            static_cast<__uint128_t>(static_cast<uint64_t>(rs2));
-        cpu.registers[rd] = res >> 64;
-        break;
-    }
-    case MULHSU: {
-        res_s = static_cast<__int128_t>(rs1) * 
-            static_cast<__uint128_t>(static_cast<uint64_t>(rs2));
-        cpu.registers[rd] = res_s >> 64;
-        break;
-    }
-    case DIV: {
-        if (cpu.registers[rs2] == 0)
-            cpu.registers[rd] = ~0;
-        else if (rs2 == -1 && rs1 == INT64_MIN)
-            cpu.registers[rd] = rs1;
-        else
-            cpu.registers[rd] = rs1 / rs2;
-        break;
-    }
-    case DIVU: {
-        if (cpu.registers[rs2] == 0)
-            cpu.registers[rd] = ~0;
-        else
-            cpu.registers[rd] = static_cast<uint64_t>(rs1) / static_cast<uint64_t>(rs2);
-        break;
-    }
-    // TODO: Check if behavior for REM is correct
-    case REM: {
-        if (rs2 == 0)
-            cpu.registers[rd] = rs1;
-        else if (rs2 == -1 && rs1 == INT64_MIN)
-            cpu.registers[rd] = 0;
-        else
-            cpu.registers[rd] = rs1 % rs2;
-        break;
-    }
-    case REMU: {
-        if (rs2 == 0)
-            cpu.registers[rd] = rs1;
-        else
-            cpu.registers[rd] = static_cast<uint64_t>(rs1) % static_cast<uint64_t>(rs2);
-        break;
-    }
-    }
-}
 
-void handle_op_op_32(uint32_t inst, Cpu &cpu) {
-    enum funct {
-        ADDW = 0b000,
-        SUBW = 0b0100000000,
-        SLLW = 0b001,
-        SRLW = 0b101,
-        SRAW = 0b0100000101,
-        MULW = 0b0000001000,
-        DIVW = 0b0000001100,
-        DIVUW = 0b0000001101,
-        REMW = 0b0000001110,
-        REMUW = 0b0000001111,
-    };
+    cpu.mark_dirty(dst, bytes);
+    for (const auto &ind : idiom.inductions)
+        cpu.registers[ind.reg] = static_cast<uint64_t>(cpu.registers[ind.reg]) + iters * ind.step;
+    cpu.budget -= insts;
+    return true;
+}
 
-    uint16_t funct = ((inst >> 12) & 0b111) | ((inst >> 22) & 0b1111111000);
+template<CpuConfig cfg, std::size_t size, bool is_signed>
+void handle_load(uint32_t inst, Cpu &cpu) {
     std::size_t rd = (inst >> 7) & 0x1f;
-    int32_t rs1 = cpu.registers[(inst >> 15) & 0x1f];
-    int32_t rs2 = cpu.registers[(inst >> 20) & 0x1f];
+    std::size_t rs1 = (inst >> 15) & 0x1f;
+    uint64_t raw_address = cpu.registers[rs1] + get_i_imm(inst);
 
-    switch (funct) {
-    case ADDW: {
-        cpu.registers[rd] = rs1 + rs2;
-        break;
-    }
-    case SUBW: {
-        cpu.registers[rd] = rs1 - rs2;
-        break;
-    }
-    case SLLW: {
-        cpu.registers[rd] = rs1 << (rs2 & 0x3f);
-        break;
-    }
-    case SRLW: {
-        cpu.registers[rd] = static_cast<uint32_t>(rs1) >> (rs2 & 0x3f);
-        break;
-    }
-    case SRAW: {
-        cpu.registers[rd] = rs1 >> (rs2 & 0x3f);
-        break;
-    }
-    case MULW: {
-        cpu.registers[rd] = rs1 * rs2;
-        break;
-    }
-    case DIVW: {
-        if (rs2 == 0)
-            cpu.registers[rd] = ~0;
-        else if (rs2 == -1 && cpu.registers[rs1] == INT32_MIN)
-            cpu.registers[rd] = rs1;
-        else
-            cpu.registers[rd] = rs1 / rs2;
-        break;
-    }
-    case DIVUW: {
-        if (rs2 == 0)
-            cpu.registers[rd] = ~0;
-        else
-            cpu.registers[rd] = static_cast<uint32_t>(rs1) / static_cast<uint32_t>(rs2);
-        break;
-    }
-    // TODO: Check if behavior for REM(U)W is correct
-    case REMW: {
-        if (rs2 == 0)
-            cpu.registers[rd] = rs1;
-        else if (rs2 == -1 && rs1 == INT32_MIN)
-            cpu.registers[rd] = 0;
-        else
-            cpu.registers[rd] = rs1 % rs2;
-        break;
-    }
-    case REMUW: {
-        if (rs2 == 0)
-            cpu.registers[rd] = rs1;
-        else
-            cpu.registers[rd] = static_cast<uint32_t>(rs1) % static_cast<uint32_t>(rs2);
-        break;
-    }
+    // UART registers are a byte wide, wider loads just see the register zero extended
+    if (uart_contains(raw_address)) {
+        uint8_t byte = cpu.uart.read(raw_address - uart_base);
+        if (rd != 0)
+            cpu.registers[rd] = is_signed && size == 1 ? static_cast<int8_t>(byte) : byte;
+        return;
     }
-}
 
-void handle_op_branch(uint32_t inst, Cpu &cpu) {
-    enum funct3 {
-        BEQ = 0b000,
-        BNE = 0b001,
-        BLT = 0b100,
-        BLTU = 0b110,
-        BGE = 0b101,
-        BGEU = 0b111,
-    };
-
-    auto imm = get_b_imm(inst);
+    uint64_t address = raw_address;
+    const uint8_t *src = cpu.mapped(raw_address, size, false);
+    if (src == nullptr) {
+        address = translate<cfg>(raw_address, size);
+        src = cpu.memory->data() + address;
+    }
+    if (cfg.stats && cpu.caches)
+        cpu.caches->data(cpu.pc, address, size, false);
 
-    std::cout << std::format("b_imm: {}\n", imm);
+    uint64_t loaded = load_shared<size>(src);
+    if constexpr (is_signed && size < 8)
+        loaded = static_cast<int64_t>(loaded << (64 - 8 * size)) >> (64 - 8 * size);
+    if (rd != 0)
+        cpu.registers[rd] = loaded;
+}
 
-    uint8_t funct3 = (inst >> 12) & 0b111;
+template<CpuConfig cfg, std::size_t size>
+void handle_store(uint32_t inst, Cpu &cpu) {
     std::size_t rs1 = (inst >> 15) & 0x1f;
     std::size_t rs2 = (inst >> 20) & 0x1f;
-    bool take_branch = false;
+    uint64_t raw_address = cpu.registers[rs1] + get_s_imm(inst);
 
-    switch (funct3) {
-    case BEQ: {
-        if (cpu.registers[rs1] == cpu.registers[rs2])
-            take_branch = true;
-        break;
-    }
-    case BNE: {
-        if (cpu.registers[rs1] != cpu.registers[rs2])
-            take_branch = true;
-        break;
-    }
-    case BLT: {
-        if (cpu.registers[rs1] < cpu.registers[rs2])
-            take_branch = true;
-        break;
-    }
-    case BGE: {
-        if (cpu.registers[rs1] >= cpu.registers[rs2])
-            take_branch = true;
-        break;
-    }
-    case BLTU: {
-        if (static_cast<uint64_t>(cpu.registers[rs1]) < static_cast<uint64_t>(cpu.registers[rs2]))
-            take_branch = true;
-        break;
-    }
-    case BGEU: {
-        if (static_cast<uint64_t>(cpu.registers[rs1]) >= static_cast<uint64_t>(cpu.registers[rs2]))
-            take_branch = true;
-        break;
-    }
+    if (uart_contains(raw_address)) {
+        cpu.uart.write(raw_address - uart_base, cpu.registers[rs2]);
+        return;
     }
 
-    if (take_branch)
-        cpu.pc += imm - 4;
-}
+    uint64_t address = raw_address;
+    uint8_t *dst = cpu.mapped(raw_address, size, true);
+    if (dst == nullptr) {
+        address = translate<cfg>(raw_address, size);
+        dst = cpu.memory->data() + address;
+        cpu.mark_dirty(address, size);
+        if (cfg.stats && cpu.tracer)
+            cpu.tracer->mem_write(address, size);
+    }
+    if (cfg.stats && cpu.caches)
+        cpu.caches->data(cpu.pc, address, size, true);
 
-void handle_op_load(uint32_t inst, Cpu &cpu) {
-    enum funct3 {
-        LB = 0b000,
-        LH = 0b001,
-        LW = 0b010,
-        LD = 0b011,
-        LBU = 0b100,
-        LHU = 0b101,
-        LWU = 0b110,
-    };
+    if (!cpu.reservations.empty())
+        cpu.invalidate(address);
 
-    uint16_t funct3 = (inst >> 12) & 0b111;
-    std::size_t rd = (inst >> 7) & 0x1f;
-    std::size_t rs1 = (inst >> 15) & 0x1f;
-    auto imm = get_i_imm(inst);
-    auto address = (cpu.registers[rs1] + imm) % mem_size;
+    store_shared<size>(dst, cpu.registers[rs2]);
+}
 
-    qword_u loaded;
-    switch (funct3) {
-    case LB: {
-        cpu.registers[rd] = static_cast<int8_t>((*cpu.memory)[address]);
-        break;
-    }
-    case LH: {
-        loaded.bytes[0] = (*cpu.memory)[address];
-        loaded.bytes[1] = (*cpu.memory)[address+1];
-        cpu.registers[rd] = loaded.word_s;
-        break;
-    }
-    case LW: {
-        loaded.bytes[0] = (*cpu.memory)[address];
-        loaded.bytes[1] = (*cpu.memory)[address+1];
-        loaded.bytes[2] = (*cpu.memory)[address+2];
-        loaded.bytes[3] = (*cpu.memory)[address+3];
-        cpu.registers[rd] = loaded.dword_s;
-        break;
-    }
-    case LD: {
-        loaded.bytes[0] = (*cpu.memory)[address];
-        loaded.bytes[1] = (*cpu.memory)[address+1];
-        loaded.bytes[2] = (*cpu.memory)[address+2];
-        loaded.bytes[3] = (*cpu.memory)[address+3];
-        loaded.bytes[4] = (*cpu.memory)[address+4];
-        loaded.bytes[5] = (*cpu.memory)[address+5];
-        loaded.bytes[6] = (*cpu.memory)[address+6];
-        loaded.bytes[7] = (*cpu.memory)[address+7];
-        cpu.registers[rd] = loaded.qword_s;
-        break;
-    }
-    case LBU: {
-        cpu.registers[rd] = (*cpu.memory)[address];
-        break;
+// Returns where a hypercall's range starts on the host, faulting unless it fits entirely in memory or in a mapped
+// file. Writes are accounted for like stores are.
+template<CpuConfig cfg>
+uint8_t *hypercall_range(Cpu &cpu, uint64_t addr, uint64_t size, bool write) {
+    if (size == 0)
+        return cpu.memory->data();
+    uint8_t *host = cpu.mapped(addr, size, write);
+    if (host == nullptr) {
+        if (addr >= mem_size || mem_size - addr < size)
+            throw std::runtime_error(std::format("hypercall range out of bounds: 0x{:x} ({} bytes)", addr, size));
+        host = cpu.memory->data() + addr;
+        if (write) {
+            cpu.mark_dirty(addr, size);
+            if (cfg.stats && cpu.tracer)
+                cpu.tracer->mem_write(addr, size);
+        }
     }
-    case LHU: {
-        loaded.bytes[0] = (*cpu.memory)[address];
-        loaded.bytes[1] = (*cpu.memory)[address+1];
-        cpu.registers[rd] = loaded.word;
-        break;
+
+    if (cfg.stats && cpu.caches)
+        cpu.caches->data(cpu.pc, addr, size, write);
+    if (write && !cpu.reservations.empty()) {
+        std::erase_if(cpu.reservations,
+                [addr, size](const Reservation &res) { return res.addr >= addr && res.addr - addr < size; });
     }
-    case LWU: {
-        loaded.bytes[0] = (*cpu.memory)[address];
-        loaded.bytes[1] = (*cpu.memory)[address+1];
-        loaded.bytes[2] = (*cpu.memory)[address+2];
-        loaded.bytes[3] = (*cpu.memory)[address+3];
-        cpu.registers[rd] = loaded.dword;
+    return host;
+}
+
+// Runs the hypercall in x10, see ecall_nums. Returns false if x10 isn't a hypercall.
+template<CpuConfig cfg>
+bool handle_hypercall(Cpu &cpu) {
+    uint64_t call = cpu.registers[10];
+    uint64_t arg1 = cpu.registers[11];
+    uint64_t arg2 = cpu.registers[12];
+    uint64_t arg3 = cpu.registers[13];
+
+    switch (call) {
+    // Overlapping memcpy arguments are undefined behavior, so memmove does for both
+    case HYPERCALL_MEMCPY:
+    case HYPERCALL_MEMMOVE: {
+        const uint8_t *src = hypercall_range<cfg>(cpu, arg2, arg3, false);
+        uint8_t *dst = hypercall_range<cfg>(cpu, arg1, arg3, true);
+        std::memmove(dst, src, arg3);
+        cpu.registers[10] = arg1;
+        break;
+    }
+    case HYPERCALL_MEMSET: {
+        std::memset(hypercall_range<cfg>(cpu, arg1, arg3, true), static_cast<uint8_t>(arg2), arg3);
+        cpu.registers[10] = arg1;
+        break;
+    }
+    case HYPERCALL_MEMCMP: {
+        const uint8_t *lhs = hypercall_range<cfg>(cpu, arg1, arg3, false);
+        const uint8_t *rhs = hypercall_range<cfg>(cpu, arg2, arg3, false);
+        int cmp = std::memcmp(lhs, rhs, arg3);
+        cpu.registers[10] = (cmp > 0) - (cmp < 0);
+        break;
+    }
+    case HYPERCALL_STRLEN: {
+        const uint8_t *str;
+        std::size_t limit;
+        if (auto mapping = cpu.mapping_at(arg1)) {
+            str = mapping->data() + (arg1 - mapping->base());
+            limit = mapping->end() - arg1;
+        } else if (arg1 < mem_size) {
+            str = cpu.memory->data() + arg1;
+            limit = mem_size - arg1;
+        } else {
+            throw std::runtime_error(std::format("hypercall range out of bounds: 0x{:x}", arg1));
+        }
+        auto end = static_cast<const uint8_t *>(std::memchr(str, 0, limit));
+        if (end == nullptr)
+            throw std::runtime_error(std::format("string at 0x{:x} runs past the end of its memory", arg1));
+        hypercall_range<cfg>(cpu, arg1, end - str + 1, false);
+        cpu.registers[10] = end - str;
         break;
     }
+    default:
+        return false;
     }
-}
 
-void handle_op_store(uint32_t inst, Cpu &cpu) {
-    enum funct3 {
-        SB = 0b000,
-        SH = 0b001,
-        SW = 0b010,
-        SD = 0b011,
-    };
-
-    uint16_t funct3 = (inst >> 12) & 0b111;
-    std::size_t rs1 = (inst >> 15) & 0x1f;
-    std::size_t rs2 = (inst >> 20) & 0x1f;
-    auto imm = get_s_imm(inst);
-    auto address = (cpu.registers[rs1] + imm) % mem_size;
-
-    qword_u storing{};
-    storing.qword = cpu.registers[rs2];
-
-    switch (funct3) {
-    case SD:
-        (*cpu.memory)[address + 7] = storing.bytes[7];
-        (*cpu.memory)[address + 6] = storing.bytes[6];
-        (*cpu.memory)[address + 5] = storing.bytes[5];
-        (*cpu.memory)[address + 4] = storing.bytes[4];
-        [[fallthrough]];
-    case SW:
-        (*cpu.memory)[address + 3] = storing.bytes[3];
-        (*cpu.memory)[address + 2] = storing.bytes[2];
-        [[fallthrough]];
-    case SH:
-        (*cpu.memory)[address + 1] = storing.bytes[1];
-        [[fallthrough]];
-    case SB:
-        (*cpu.memory)[address] = storing.bytes[0];
+    if constexpr (cfg.trace >= 2) {
+        cpu.uart.flush();
+        std::cout << std::format("hypercall 0x{:x} @ 0x{:08x}\n", call, cpu.pc);
     }
+    return true;
 }
 
-std::optional<int> handle_op_system(uint32_t inst, Cpu &cpu) {
-    uint8_t funct12 = inst >> 20;
-
-    if (funct12 == 1) // EBREAK
+template<CpuConfig cfg>
+std::optional<int> handle_ecall(Cpu &cpu) {
+    // Hypercalls are too frequent for register dumps
+    if (handle_hypercall<cfg>(cpu))
         return std::nullopt;
 
-    // ECALL
-    std::cout << std::format("ecall @ 0x{:08x}\n", cpu.pc);
-    cpu.dump_regs();
+    if constexpr (cfg.trace >= 1) {
+        cpu.uart.flush();
+        std::cout << std::format("ecall @ 0x{:08x}\n", cpu.pc);
+        cpu.dump_regs();
+    }
 
-    if (cpu.registers[10] == 1) {
-        std::cout << "exit syscall: x10 = 1\n";
+    if (cpu.registers[10] == ECALL_EXIT) {
+        if constexpr (cfg.trace >= 1)
+            std::cout << "exit syscall: x10 = 1\n";
         return cpu.registers[11];
     }
 
     return std::nullopt;
 }
 
-template<typename T, typename UT>
-void handle_amo_gen(std::size_t funct5, std::size_t rd, std::size_t rs1, std::size_t rs2, Cpu &cpu) {
+template<CpuConfig cfg, typename T, typename UT, uint8_t funct5>
+void handle_amo(std::size_t rd, std::size_t rs1, std::size_t rs2, Cpu &cpu) {
     enum funct5_vals {
         LR      = 0b00010,
         SC      = 0b00011,
@@ -562,96 +441,334 @@ void handle_amo_gen(std::size_t funct5, std::size_t rd, std::size_t rs1, std::si
     if (addr % sizeof(T) != 0)
         throw std::runtime_error("AMO address misalignment");
 
-    T *addr_ptr = (T *)&(*cpu.memory)[addr];
-    cpu.registers[rd] = *addr_ptr;
+    T *addr_ptr = (T *)cpu.mapped(addr, sizeof(T), funct5 != LR);
+    bool in_memory = addr_ptr == nullptr;
+    if (in_memory) {
+        addr = translate<cfg>(addr, sizeof(T));
+        addr_ptr = (T *)&(*cpu.memory)[addr];
+    }
+
+    if (funct5 != LR && funct5 != SC && !cpu.reservations.empty())
+        cpu.invalidate(addr);
+
+    /* Memory is only accessed atomically, as harts may run on other host threads, see scheduler.hpp. Min and max
+     * have no host equivalent, so they retry until no other store came in between.
+     * */
+    std::atomic_ref<T> mem{*addr_ptr};
+    auto update = [&mem](auto pick) {
+        T cur = mem.load();
+        while (!mem.compare_exchange_weak(cur, pick(cur)))
+            ;
+        return cur;
+    };
+    auto &ctx = cpu.contexts[cpu.cur_hart];
+    // rd only gets the old value once memory is updated, in case it's also rs2
+    T old = 0;
+    T src = cpu.registers[rs2];
 
     switch (funct5) {
     // Load reserved. Registers a reservation set and loads 
     case LR: {
-        std::cout << "LR\n";
-        cpu.contexts[cpu.cur_hart].last_lr = cpu.pc;
-        cpu.reserve(addr, cpu.pc);
+        old = mem.load();
+        // Coming back to the same LR without a successful SC means the hart is spinning on a lock, let others run
+        if (ctx.last_lr == cpu.pc)
+            cpu.slice = 0;
+        ctx.last_lr = cpu.pc;
+        ctx.lr_value = static_cast<UT>(old);
+        if (cpu.multi_hart)
+            cpu.reserve(addr, cpu.pc);
+        else
+            ctx.lr_addr = addr;
         break;
     }
     // Store conditional. If reservation set is maintained, store rs2 into [rs1], then write 0 into rd. Else, 
     // write 1 into rd.
     case SC: {
-        std::cout << "SC\n";
-        auto& last_lr = cpu.contexts[cpu.cur_hart].last_lr;
+        old = 1;
 
-        auto inv = cpu.invalidate(addr);
+        if (cpu.multi_hart) {
+            auto inv = cpu.invalidate(addr);
 
-        if (last_lr == std::nullopt || inv == std::nullopt || *inv != *last_lr) {
-            cpu.registers[rd] = 1;
-            return;
+            if (ctx.last_lr == std::nullopt || inv == std::nullopt || *inv != *ctx.last_lr)
+                break;
+        } else {
+            // A single hart can only lose its reservation by reserving something else
+            if (ctx.last_lr == std::nullopt || ctx.lr_addr != addr)
+                break;
         }
 
-        last_lr = std::nullopt;
-        *addr_ptr = cpu.registers[rs2];
-        cpu.registers[rd] = 0;
+        T expected = static_cast<T>(ctx.lr_value);
+        if (!mem.compare_exchange_strong(expected, src))
+            break;
+        ctx.last_lr = std::nullopt;
+        old = 0;
+        cpu.wake_events++;
         break;
     }
     case AMOSWAP: {
-        *addr_ptr = cpu.registers[rs2];
+        old = mem.exchange(src);
         break;
     }
     case AMOADD: {
-        *addr_ptr = cpu.registers[rd] + cpu.registers[rs2];
+        old = mem.fetch_add(src);
         break;
     }
     case AMOXOR: {
-        *addr_ptr = cpu.registers[rd] ^ cpu.registers[rs2];
+        old = mem.fetch_xor(src);
         break;
     }
     case AMOAND: {
-        *addr_ptr = cpu.registers[rd] & cpu.registers[rs2];
+        old = mem.fetch_and(src);
         break;
     }
     case AMOOR: {
-        *addr_ptr = cpu.registers[rd] | cpu.registers[rs2];
+        old = mem.fetch_or(src);
         break;
     }
     case AMOMIN: {
-        if (cpu.registers[rs2] < cpu.registers[rd]) {
-            *addr_ptr = cpu.registers[rs2];
-        }
+        old = update([src](T cur) { return std::min(cur, src); });
         break;
     }
     case AMOMAX: {
-        if (cpu.registers[rs2] > cpu.registers[rd]) {
-            *addr_ptr = cpu.registers[rs2];
-        }
+        old = update([src](T cur) { return std::max(cur, src); });
         break;
     }
     case AMOMINU: {
-        if (static_cast<UT>(cpu.registers[rs2]) < static_cast<UT>(cpu.registers[rd])) {
-            *addr_ptr = cpu.registers[rs2];
-        }
+        old = update([src](T cur) { return static_cast<T>(std::min<UT>(cur, src)); });
         break;
     }
     case AMOMAXU: {
-        if (static_cast<UT>(cpu.registers[rs2]) > static_cast<UT>(cpu.registers[rd])) {
-            *addr_ptr = cpu.registers[rs2];
-        }
+        old = update([src](T cur) { return static_cast<T>(std::max<UT>(cur, src)); });
         break;
     }
     }
+
+    if constexpr (funct5 != LR && funct5 != SC)
+        cpu.wake_events++;
+
+    // LR, and SC when it fails, only read
+    bool stored = funct5 != LR && (funct5 != SC || old == 0);
+    if (cfg.stats && cpu.caches)
+        cpu.caches->data(cpu.pc, addr, sizeof(T), stored);
+    if (stored && in_memory) {
+        cpu.mark_dirty(addr, sizeof(T));
+        if (cfg.stats && cpu.tracer)
+            cpu.tracer->mem_write(addr, sizeof(T));
+    }
+
+    if (rd != 0)
+        cpu.registers[rd] = old;
+}
+
+/* Executes an instruction described by inst_specs[id], returning the guest's exit code if it exited. There is an
+ * instance for every instruction in every configuration, so that all of the spec, down to the ALU operation, is
+ * folded in at compile time.
+ * */
+template<CpuConfig cfg, std::size_t id>
+std::optional<int> execute(uint32_t inst, Cpu &cpu) {
+    constexpr InstSpec spec = inst_specs[id];
+    std::size_t rd = (inst >> 7) & 0x1f;
+    std::size_t rs1 = (inst >> 15) & 0x1f;
+    std::size_t rs2 = (inst >> 20) & 0x1f;
+
+    if constexpr (spec.kind == Kind::ALU) {
+        if (rd != 0)
+            cpu.registers[rd] = spec.op(cpu.registers[rs1], cpu.registers[rs2]);
+    } else if constexpr (spec.kind == Kind::ALU_IMM) {
+        if (rd != 0)
+            cpu.registers[rd] = spec.op(cpu.registers[rs1], get_i_imm(inst));
+    } else if constexpr (spec.kind == Kind::LUI) {
+        if (rd != 0)
+            cpu.registers[rd] = get_u_imm(inst);
+    } else if constexpr (spec.kind == Kind::AUIPC) {
+        if (rd != 0)
+            cpu.registers[rd] = get_u_imm(inst) + cpu.pc;
+    } else if constexpr (spec.kind == Kind::JAL) {
+        // TODO: Generate address misaligned exceptions for jump instructions
+        if (rd != 0)
+            cpu.registers[rd] = cpu.pc + 4;
+        cpu.pc += get_j_imm(inst) - 4;
+    } else if constexpr (spec.kind == Kind::JALR) {
+        uint64_t target = (cpu.registers[rs1] + get_i_imm(inst)) & ~1ull;
+        if (rd != 0)
+            cpu.registers[rd] = cpu.pc + 4;
+        cpu.pc = target - 4;
+    } else if constexpr (spec.kind == Kind::BRANCH) {
+        if (spec.op(cpu.registers[rs1], cpu.registers[rs2])) {
+            auto imm = get_b_imm(inst);
+            if constexpr (cfg.stats)
+                cpu.stats.branches_taken++;
+            if constexpr (supports_loop_idioms(cfg)) {
+                if (imm < 0 && cpu.idioms && run_loop_idiom<cfg>(cpu, cpu.pc + imm))
+                    return std::nullopt;
+            }
+            cpu.pc += imm - 4;
+        }
+    } else if constexpr (spec.kind == Kind::LOAD) {
+        handle_load<cfg, spec.size, spec.is_signed>(inst, cpu);
+    } else if constexpr (spec.kind == Kind::STORE) {
+        handle_store<cfg, spec.size>(inst, cpu);
+    } else if constexpr (spec.kind == Kind::AMO && spec.size == 4) {
+        handle_amo<cfg, int32_t, uint32_t, (spec.match >> 27)>(rd, rs1, rs2, cpu);
+    } else if constexpr (spec.kind == Kind::AMO && spec.size == 8) {
+        handle_amo<cfg, int64_t, uint64_t, (spec.match >> 27)>(rd, rs1, rs2, cpu);
+    } else if constexpr (spec.kind == Kind::ECALL) {
+        return handle_ecall<cfg>(cpu);
+    } else if constexpr (spec.kind == Kind::WFI) {
+        // There are no interrupts to wait for, so on its own a hart just carries on
+        cpu.waiting = true;
+        cpu.slice = 0;
+    }
+    // FENCE and EBREAK are handled as noops, and so are unknown instructions
+
+    return std::nullopt;
 }
 
-void handle_op_amo(uint32_t inst, Cpu &cpu) {
+template<CpuConfig cfg, std::size_t id>
+constexpr std::size_t supported_id() {
+    return has_ext(cfg, inst_specs[id].ext) ? id : 0;
+}
+
+// The register an instruction leaves its result in for the binary trace. Hypercalls return in x10.
+static std::size_t written_register(std::size_t id, uint32_t inst) {
+    switch (inst_specs[id].format) {
+    case Format::NONE:
+        return inst_specs[id].kind == Kind::ECALL ? 10 : 0;
+    case Format::S:
+    case Format::B:
+        return 0;
+    default:
+        return (inst >> 7) & 0x1f;
+    }
+}
 
-    std::size_t rd = (inst >> 7) & 0b11111;
-    uint8_t width = (inst >> 12) & 0b111;
-    std::size_t rs1 = (inst >> 15) & 0b11111;
-    std::size_t rs2 = (inst >> 20) & 0b11111;
-    uint8_t funct5 = (inst >> 27) & 0b11111;
+// Executes the instruction with index id into inst_specs, see decode(), and accounts for it
+template<CpuConfig cfg, std::size_t id>
+std::optional<int> complete(uint32_t inst, Cpu &cpu) {
+    [[maybe_unused]] uint64_t inst_pc = cpu.pc;
+    if constexpr (cfg.stats) {
+        cpu.stats.retired++;
+        cpu.stats.insts[id]++;
+    }
 
-    // WORD
-    if (width == 2) {
-        handle_amo_gen<int32_t, uint32_t>(funct5, rd, rs1, rs2, cpu);
+    if (auto rc = execute<cfg, supported_id<cfg, id>()>(inst, cpu)) {
+        if (cfg.stats && cpu.tracer)
+            cpu.tracer->retire(inst_pc, 0, cpu.registers.data(), cpu.memory->data());
+        return rc;
     }
-    // DWORD
-    else if (width == 3) {
-        handle_amo_gen<int64_t, uint64_t>(funct5, rd, rs1, rs2, cpu);
+
+    if (cfg.stats && cpu.tracer)
+        cpu.tracer->retire(inst_pc, written_register(id, inst), cpu.registers.data(), cpu.memory->data());
+
+    cpu.pc += 4;
+    return std::nullopt;
+}
+
+/* Instances of complete() indexed by id. step() ends in a jump through this, so every instruction's handler is
+ * compiled on its own with execute() inlined into it, and runs without going through a chain of comparisons.
+ * */
+template<CpuConfig cfg, std::size_t... Ids>
+constexpr std::array<std::optional<int> (*)(uint32_t, Cpu &), sizeof...(Ids)> make_handlers(
+        std::index_sequence<Ids...>) {
+    return {&complete<cfg, Ids>...};
+}
+
+template<CpuConfig cfg>
+constexpr auto handlers = make_handlers<cfg>(std::make_index_sequence<inst_specs.size()>{});
+
+template<CpuConfig cfg>
+std::optional<int> step(Cpu &cpu) {
+    if (cpu.budget-- == 0)
+        throw BudgetExhausted("instruction budget exhausted");
+
+    // Faults rather than exits, so that callers can tell these apart from a guest exiting with 1
+    if (cpu.pc >= mem_size)
+        throw std::runtime_error("invalid pc value");
+
+    // fetch
+    dword_u inst_bytes{};
+    inst_bytes.bytes[0] = (*cpu.memory)[cpu.pc];
+    inst_bytes.bytes[1] = (*cpu.memory)[cpu.pc+1];
+    inst_bytes.bytes[2] = (*cpu.memory)[cpu.pc+2];
+    inst_bytes.bytes[3] = (*cpu.memory)[cpu.pc+3];
+    auto inst = inst_bytes.dword;
+
+    if constexpr (cfg.trace >= 2) {
+        cpu.uart.flush();
+        std::cout << std::format("fetched: 0x{:08x} @ 0x{:08x}\t{}\n", inst, cpu.pc, disassemble(inst, cpu.pc));
+    }
+
+    if (cfg.stats && cpu.caches)
+        cpu.caches->fetch(cpu.pc);
+
+    if (inst == 0) {
+        if constexpr (cfg.trace >= 1)
+            cpu.dump_regs();
+        throw std::runtime_error("invalid instruction 0x00000000");
+    }
+
+    if (cfg.stats && cpu.tracer)
+        cpu.tracer->begin(cpu.pc, cpu.registers.data(), cpu.memory->data());
+
+    // decode, execute
+    return handlers<cfg>[decode(inst)](inst, cpu);
+}
+
+template<CpuConfig cfg>
+int run(Cpu &cpu) {
+    for (;;) {
+        if (auto rc = step<cfg>(cpu))
+            return *rc;
+    }
+}
+
+template<CpuConfig cfg>
+std::optional<int> run_slice(Cpu &cpu) {
+    while (cpu.slice != 0) {
+        cpu.slice--;
+        if (auto rc = step<cfg>(cpu))
+            return rc;
+    }
+    return std::nullopt;
+}
+
+/* PRE-INSTANTIATED VARIANTS
+ * =========================
+ * Every combination of the options below gets its own copy of the interpreter. Variants are numbered with
+ * the first option varying fastest. Cache simulation and binary traces run on the variants with statistics,
+ * which go through Cpu::caches and Cpu::tracer whenever they are present.
+ * */
+constexpr std::array isa_variants{
+    CpuConfig{.ext_m = false, .ext_a = false, .ext_b = false}, // rv64i
+    CpuConfig{.ext_m = true, .ext_a = true, .ext_b = false},   // rv64ima
+    CpuConfig{.ext_m = true, .ext_a = true, .ext_b = true},    // rv64ima_zba_zbb_zbs
+};
+constexpr unsigned trace_levels = 3;
+
+constexpr std::size_t variant_count = isa_variants.size() * trace_levels * 2 * 2;
+
+constexpr CpuConfig variant_config(std::size_t ind) {
+    CpuConfig cfg = isa_variants[ind % isa_variants.size()];
+    ind /= isa_variants.size();
+    cfg.trace = ind % trace_levels;
+    ind /= trace_levels;
+    cfg.stats = ind % 2;
+    cfg.checked_mem = (ind / 2) % 2;
+    return cfg;
+}
+
+template<std::size_t... Inds>
+constexpr std::array<CpuVariant, sizeof...(Inds)> make_variants(std::index_sequence<Inds...>) {
+    return {CpuVariant {&run<variant_config(Inds)>, &step<variant_config(Inds)>,
+        &run_slice<variant_config(Inds)>}...};
+}
+
+constexpr auto variants = make_variants(std::make_index_sequence<variant_count>{});
+
+const CpuVariant *select_variant(const CpuConfig &cfg) {
+    for (std::size_t i = 0; i < variant_count; i++) {
+        if (variant_config(i) == cfg)
+            return &variants[i];
     }
+    return nullptr;
 }
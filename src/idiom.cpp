@@ -0,0 +1,166 @@
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <optional>
+
+#include "cpu.hpp"
+#include "idiom.hpp"
+#include "util.hpp"
+
+namespace {
+
+// Longest loop body looked at, anything bigger isn't a plain copy or fill
+constexpr std::size_t max_body = 8;
+
+struct Access {
+    std::size_t index;
+    std::size_t reg; // loaded into, or stored
+    std::size_t base;
+    int64_t offset;
+    const InstSpec *spec;
+};
+
+}
+
+LoopIdiom match_loop_idiom(const uint8_t *memory, uint64_t head, uint64_t branch_pc) {
+    LoopIdiom idiom{.head = head};
+    if (head >= branch_pc || (branch_pc - head) / 4 + 1 > max_body)
+        return idiom;
+
+    for (uint64_t pc = head; pc <= branch_pc; pc += 4) {
+        uint32_t inst;
+        std::memcpy(&inst, memory + pc, sizeof(inst));
+        idiom.body.push_back(inst);
+    }
+
+    std::optional<Access> load, store;
+    // Position of each induction's ADDI in the body
+    std::vector<std::size_t> induction_index;
+
+    for (std::size_t i = 0; i + 1 < idiom.body.size(); i++) {
+        uint32_t inst = idiom.body[i];
+        const InstSpec &spec = inst_specs[decode(inst)];
+        std::size_t rd = (inst >> 7) & 0x1f;
+        std::size_t rs1 = (inst >> 15) & 0x1f;
+        std::size_t rs2 = (inst >> 20) & 0x1f;
+
+        switch (spec.kind) {
+        case Kind::ALU_IMM: {
+            auto written = [rd](const Induction &ind) { return ind.reg == rd; };
+            if (spec.op != alu_add || rd != rs1 || rd == 0 || std::ranges::any_of(idiom.inductions, written))
+                return LoopIdiom {.head = head};
+            idiom.inductions.push_back({.reg = rd, .step = get_i_imm(inst)});
+            induction_index.push_back(i);
+            break;
+        }
+        case Kind::LOAD: {
+            if (load || rd == 0)
+                return LoopIdiom {.head = head};
+            load = Access {.index = i, .reg = rd, .base = rs1, .offset = get_i_imm(inst), .spec = &spec};
+            break;
+        }
+        case Kind::STORE: {
+            if (store)
+                return LoopIdiom {.head = head};
+            store = Access {.index = i, .reg = rs2, .base = rs1, .offset = get_s_imm(inst), .spec = &spec};
+            break;
+        }
+        default:
+            return LoopIdiom {.head = head};
+        }
+    }
+
+    if (!store)
+        return LoopIdiom {.head = head};
+    idiom.width = store->spec->size;
+
+    auto find_induction = [&](std::size_t reg) -> std::optional<std::size_t> {
+        for (std::size_t i = 0; i < idiom.inductions.size(); i++) {
+            if (idiom.inductions[i].reg == reg)
+                return i;
+        }
+        return std::nullopt;
+    };
+    auto invariant = [&](std::size_t reg) {
+        return !find_induction(reg) && (!load || load->reg != reg);
+    };
+
+    // Offset from the register's value at the top of the loop to the access, counting a bump made before it
+    auto locate = [&](const Access &access, std::size_t &reg, int64_t &offset) {
+        auto ind = find_induction(access.base);
+        if (!ind || idiom.inductions[*ind].step != static_cast<int64_t>(idiom.width))
+            return false;
+        reg = access.base;
+        offset = access.offset + (induction_index[*ind] < access.index ? idiom.inductions[*ind].step : 0);
+        return true;
+    };
+
+    if (!locate(*store, idiom.dst_reg, idiom.dst_offset))
+        return LoopIdiom {.head = head};
+
+    if (load) {
+        if (load->spec->size != store->spec->size || load->reg != store->reg || load->index > store->index
+                || find_induction(load->reg) || !locate(*load, idiom.src_reg, idiom.src_offset))
+            return LoopIdiom {.head = head};
+        idiom.kind = IdiomKind::COPY;
+        idiom.value_reg = load->reg;
+        idiom.load_signed = load->spec->is_signed;
+    } else {
+        if (!invariant(store->reg))
+            return LoopIdiom {.head = head};
+        idiom.kind = IdiomKind::FILL;
+        idiom.value_reg = store->reg;
+    }
+
+    uint32_t branch = idiom.body.back();
+    const InstSpec &branch_spec = inst_specs[decode(branch)];
+    idiom.branch_cond = branch_spec.op;
+    std::size_t rs1 = (branch >> 15) & 0x1f;
+    std::size_t rs2 = (branch >> 20) & 0x1f;
+
+    if (branch_spec.kind != Kind::BRANCH
+            || (idiom.branch_cond != alu_ne && idiom.branch_cond != alu_slt && idiom.branch_cond != alu_sltu))
+        return LoopIdiom {.head = head};
+
+    if (find_induction(rs1) && invariant(rs2)) {
+        idiom.counter = rs1;
+        idiom.bound = rs2;
+    } else if (idiom.branch_cond == alu_ne && find_induction(rs2) && invariant(rs1)) {
+        idiom.counter = rs2;
+        idiom.bound = rs1;
+    } else {
+        return LoopIdiom {.head = head};
+    }
+    idiom.counter_step = idiom.inductions[*find_induction(idiom.counter)].step;
+
+    // Counting up to a bound is all that's handled for the ordered comparisons
+    if (idiom.counter_step == 0 || (idiom.branch_cond != alu_ne && idiom.counter_step < 0))
+        return LoopIdiom {.head = head};
+
+    return idiom;
+}
+
+uint64_t loop_idiom_trip_count(const LoopIdiom &idiom, const int64_t *registers) {
+    uint64_t counter = registers[idiom.counter];
+    uint64_t bound = registers[idiom.bound];
+
+    if (idiom.branch_cond == alu_ne) {
+        // counter + n * step == bound, wrapping like the registers do
+        uint64_t distance = idiom.counter_step > 0 ? bound - counter : counter - bound;
+        uint64_t step = idiom.counter_step > 0 ? idiom.counter_step : -static_cast<uint64_t>(idiom.counter_step);
+        return distance % step == 0 ? distance / step : 0;
+    }
+    if (idiom.branch_cond == alu_slt || idiom.branch_cond == alu_sltu) {
+        // The first n with counter + n * step >= bound, which mustn't wrap past the top of the range
+        bool is_signed = idiom.branch_cond == alu_slt;
+        if (is_signed ? static_cast<int64_t>(counter) >= static_cast<int64_t>(bound) : counter >= bound)
+            return 0;
+        uint64_t step = idiom.counter_step;
+        uint64_t distance = bound - counter;
+        uint64_t n = distance / step + (distance % step != 0);
+        uint64_t overshoot = n * step - distance;
+        uint64_t top = is_signed ? std::numeric_limits<int64_t>::max() : std::numeric_limits<uint64_t>::max();
+        return overshoot <= top - bound ? n : 0;
+    }
+    return 0;
+}
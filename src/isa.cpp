@@ -0,0 +1,111 @@
+#include <array>
+#include <cstdint>
+#include <format>
+#include <stdexcept>
+#include <string>
+
+#include "isa.hpp"
+#include "util.hpp"
+
+// The instruction bits decode_key() picks out, and rs2 for the secondary table
+constexpr uint32_t decode_key_mask = 0xfe00707c;
+constexpr uint32_t decode_rs2_mask = 0x01f00000;
+
+// An instruction with the fields of a decode key, and everything else zero
+constexpr uint32_t decode_key_inst(std::size_t key) {
+    return 0b11 | (key & 0x1f) << 2 | (key & 0xe0) << 7 | (key & 0x7f00) << 17;
+}
+
+// Whether an instruction with the given bits set can be spec, only looking at the bits in considered
+constexpr bool spec_matches(const InstSpec &spec, uint32_t inst, uint32_t considered) {
+    return ((inst ^ spec.match) & spec.mask & considered) == 0;
+}
+
+/* Walks every key each instruction can have, by enumerating the subsets of the key bits its mask leaves free.
+ * Keys with a single candidate that doesn't care about rs2 get it right away, the rest get a secondary block
+ * that goes through the candidates again for every rs2. Two instructions that can't be told apart even by rs2
+ * make the build fail.
+ * */
+constexpr DecodeTable build_decode_table() {
+    DecodeTable table{};
+    std::array<bool, std::size_t{1} << decode_key_bits> needs_rs2{};
+
+    for (std::size_t id = 1; id < inst_specs.size(); id++) {
+        const InstSpec &spec = inst_specs[id];
+        uint32_t free = ~spec.mask & decode_key_mask;
+        for (uint32_t bits = free;; bits = (bits - 1) & free) {
+            std::size_t key = decode_key((spec.match & decode_key_mask) | bits);
+            if (table.primary[key] != 0 || (spec.mask & decode_rs2_mask) != 0)
+                needs_rs2[key] = true;
+            table.primary[key] = id;
+            if (bits == 0)
+                break;
+        }
+    }
+
+    std::size_t blocks = 0;
+    for (std::size_t key = 0; key < table.primary.size(); key++) {
+        if (!needs_rs2[key])
+            continue;
+        if (blocks == decode_secondary_blocks)
+            throw std::logic_error("decode_secondary_blocks is too small");
+
+        for (uint32_t rs2 = 0; rs2 < 32; rs2++) {
+            uint32_t inst = decode_key_inst(key) | rs2 << 20;
+            uint16_t &entry = table.secondary[blocks * 32 + rs2];
+            for (std::size_t id = 1; id < inst_specs.size(); id++) {
+                if (!spec_matches(inst_specs[id], inst, decode_key_mask | decode_rs2_mask))
+                    continue;
+                if (entry != 0)
+                    throw std::logic_error("ambiguous instruction encodings");
+                entry = id;
+            }
+        }
+        table.primary[key] = decode_secondary_flag | blocks++;
+    }
+    return table;
+}
+
+constinit const DecodeTable decode_table = build_decode_table();
+
+std::string disassemble(uint32_t inst, uint64_t pc) {
+    std::size_t id = decode(inst);
+    if (id == 0)
+        return std::format(".word 0x{:08x}", inst);
+
+    const InstSpec &spec = inst_specs[id];
+    std::size_t rd = (inst >> 7) & 0x1f;
+    std::size_t rs1 = (inst >> 15) & 0x1f;
+    std::size_t rs2 = (inst >> 20) & 0x1f;
+    // Suffixes for the aq and rl bits of LR, SC, and the AMOs
+    constexpr const char *orders[] = {"", ".rl", ".aq", ".aqrl"};
+    const char *order = orders[(inst >> 25) & 0b11];
+
+    switch (spec.format) {
+    case Format::NONE:
+        return spec.name;
+    case Format::R:
+        return std::format("{} x{}, x{}, x{}", spec.name, rd, rs1, rs2);
+    case Format::R_UNARY:
+        return std::format("{} x{}, x{}", spec.name, rd, rs1);
+    case Format::I:
+        return std::format("{} x{}, x{}, {}", spec.name, rd, rs1, get_i_imm(inst));
+    case Format::I_SHIFT:
+        return std::format("{} x{}, x{}, {}", spec.name, rd, rs1, (inst >> 20) & 0x3f);
+    case Format::I_MEM:
+        return std::format("{} x{}, {}(x{})", spec.name, rd, get_i_imm(inst), rs1);
+    case Format::S:
+        return std::format("{} x{}, {}(x{})", spec.name, rs2, get_s_imm(inst), rs1);
+    case Format::B:
+        return std::format("{} x{}, x{}, 0x{:x}", spec.name, rs1, rs2, pc + get_b_imm(inst));
+    case Format::U:
+        return std::format("{} x{}, 0x{:x}", spec.name, rd, inst >> 12);
+    case Format::J:
+        return std::format("{} x{}, 0x{:x}", spec.name, rd, pc + get_j_imm(inst));
+    case Format::AMO:
+        return std::format("{}{} x{}, x{}, (x{})", spec.name, order, rd, rs2, rs1);
+    case Format::LR:
+        return std::format("{}{} x{}, (x{})", spec.name, order, rd, rs1);
+    }
+    return spec.name;
+}
@@ -0,0 +1,380 @@
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+#include "lockstep.hpp"
+#include "util.hpp"
+
+namespace {
+
+// out = op(a, b) for every lane, op being that of inst_specs[id]. Left to the compiler to vectorize, see
+// run_group().
+template<std::size_t Lanes, std::size_t id>
+[[gnu::always_inline]] inline void alu_lanes_of(uint64_t *__restrict out, const uint64_t *a, const uint64_t *b) {
+    constexpr alu_fn op = inst_specs[id].op;
+    if constexpr (op != nullptr) {
+        for (std::size_t lane = 0; lane < Lanes; lane++)
+            out[lane] = op(a[lane], b[lane]);
+    }
+}
+
+// Finding the instance costs a jump per instruction for all the lanes together
+template<std::size_t Lanes, std::size_t... Ids>
+[[gnu::always_inline]] inline void alu_lanes(std::size_t id, uint64_t *__restrict out, const uint64_t *a,
+        const uint64_t *b, std::index_sequence<Ids...>) {
+    ((id == Ids && (alu_lanes_of<Lanes, Ids>(out, a, b), true)) || ...);
+}
+
+template<typename F>
+void for_each_lane(uint32_t mask, F f) {
+    for (; mask != 0; mask &= mask - 1)
+        f(static_cast<std::size_t>(std::countr_zero(mask)));
+}
+
+template<std::size_t Lanes>
+class LockstepGroup {
+public:
+    LockstepGroup(std::span<Cpu *const> cpus, std::span<LaneOutcome> outcomes, const CpuConfig &cfg,
+            const CpuVariant &variant)
+        : cpus{cpus}, outcomes{outcomes}, cfg{cfg}, variant{variant} {}
+
+    [[gnu::always_inline]] void run() {
+        pc = cpus[0]->pc;
+        for (std::size_t lane = 0; lane < cpus.size(); lane++) {
+            if (cpus[lane]->pc == pc) {
+                active |= 1u << lane;
+                load(lane);
+            } else {
+                spilled |= 1u << lane;
+            }
+        }
+        refresh_limit();
+
+        while (active != 0) {
+            group_retired++;
+            // Counted up front so that lanes leaving on this instruction are charged for it
+            if (limit != 0) {
+                retired++;
+                if (execute()) {
+                    limit--;
+                    continue;
+                }
+                retired--;
+            }
+            fallback();
+        }
+
+        for_each_lane(spilled, [this](std::size_t lane) {
+            try {
+                outcomes[lane].exit_code = variant.run(*cpus[lane]);
+            } catch (const std::runtime_error &e) {
+                outcomes[lane].error = e.what();
+            }
+        });
+    }
+
+private:
+    using Row = std::array<uint64_t, Lanes>;
+
+    // Writes f(lane) into rd for every lane, including the ones that left, which nothing reads anymore
+    template<typename F>
+    [[gnu::always_inline]] void map(std::size_t rd, F f) {
+        if (rd == 0)
+            return;
+        Row out;
+        for (std::size_t lane = 0; lane < Lanes; lane++)
+            out[lane] = f(lane);
+        regs[rd] = out;
+    }
+
+    void load(std::size_t lane) {
+        for (std::size_t reg = 1; reg < regs.size(); reg++)
+            regs[reg][lane] = cpus[lane]->registers[reg];
+    }
+
+    // Hands a lane's state back to its Cpu, charging its budget for everything run in lockstep so far
+    void store(std::size_t lane, uint64_t lane_pc) {
+        Cpu &cpu = *cpus[lane];
+        for (std::size_t reg = 1; reg < regs.size(); reg++)
+            cpu.registers[reg] = regs[reg][lane];
+        cpu.pc = lane_pc;
+        cpu.budget -= retired - charged[lane];
+        charged[lane] = retired;
+    }
+
+    void leave(std::size_t lane) {
+        active &= ~(1u << lane);
+        outcomes[lane].lockstep_retired = group_retired;
+    }
+
+    // The lane's Cpu must already hold its state
+    void spill(std::size_t lane) {
+        leave(lane);
+        spilled |= 1u << lane;
+    }
+
+    // How many instructions can run in lockstep before some lane's budget has to be checked
+    void refresh_limit() {
+        limit = UINT64_MAX;
+        for_each_lane(active, [this](std::size_t lane) {
+            limit = std::min(limit, cpus[lane]->budget - (retired - charged[lane]));
+        });
+    }
+
+    // Keeps the lanes going to the most common pc and spills the others, storing their state first unless their
+    // Cpus already hold it
+    void converge(const std::array<uint64_t, Lanes> &next, bool stored) {
+        uint64_t best = pc;
+        int best_count = 0;
+        for_each_lane(active, [&](std::size_t lane) {
+            int count = 0;
+            for_each_lane(active, [&](std::size_t other) { count += next[other] == next[lane]; });
+            if (count > best_count) {
+                best = next[lane];
+                best_count = count;
+            }
+        });
+
+        for_each_lane(active, [&](std::size_t lane) {
+            if (next[lane] != best) {
+                if (!stored)
+                    store(lane, next[lane]);
+                spill(lane);
+            }
+        });
+        pc = best;
+    }
+
+    // Runs the instruction at pc on every lane's own Cpu
+    void fallback() {
+        std::array<uint64_t, Lanes> next{};
+        for_each_lane(active, [&](std::size_t lane) {
+            Cpu &cpu = *cpus[lane];
+            store(lane, pc);
+            try {
+                if (auto rc = variant.step(cpu)) {
+                    outcomes[lane].exit_code = *rc;
+                    leave(lane);
+                    return;
+                }
+            } catch (const std::runtime_error &e) {
+                outcomes[lane].error = e.what();
+                leave(lane);
+                return;
+            }
+            load(lane);
+            next[lane] = cpu.pc;
+        });
+
+        converge(next, true);
+        refresh_limit();
+    }
+
+    // Runs the instruction at pc on all lanes at once. Returns false without changing anything if it has to go
+    // through the scalar interpreter instead.
+    [[gnu::always_inline]] bool execute() {
+        const uint8_t *code = cpus[std::countr_zero(active)]->memory->data();
+        if (pc > mem_size - 4)
+            return false;
+
+        uint32_t inst;
+        std::memcpy(&inst, code + pc, sizeof(inst));
+        std::size_t id = decode(inst);
+        const InstSpec &spec = inst_specs[id];
+        if (!has_ext(cfg, spec.ext))
+            return false;
+
+        std::size_t rd = (inst >> 7) & 0x1f;
+        const Row &a = regs[(inst >> 15) & 0x1f];
+        const Row &b = regs[(inst >> 20) & 0x1f];
+
+        switch (spec.kind) {
+        case Kind::ALU: {
+            if (rd != 0)
+                alu(id, rd, a, b);
+            break;
+        }
+        case Kind::ALU_IMM: {
+            Row imm;
+            imm.fill(static_cast<int64_t>(get_i_imm(inst)));
+            if (rd != 0)
+                alu(id, rd, a, imm);
+            break;
+        }
+        case Kind::LUI: {
+            uint64_t value = static_cast<int64_t>(get_u_imm(inst));
+            map(rd, [value](std::size_t) { return value; });
+            break;
+        }
+        case Kind::AUIPC: {
+            uint64_t value = pc + get_u_imm(inst);
+            map(rd, [value](std::size_t) { return value; });
+            break;
+        }
+        case Kind::JAL: {
+            uint64_t link = pc + 4;
+            map(rd, [link](std::size_t) { return link; });
+            pc += get_j_imm(inst);
+            return true;
+        }
+        case Kind::JALR: {
+            int64_t offset = get_i_imm(inst);
+            std::array<uint64_t, Lanes> next;
+            for (std::size_t lane = 0; lane < Lanes; lane++)
+                next[lane] = (a[lane] + offset) & ~uint64_t{1};
+            uint64_t link = pc + 4;
+            map(rd, [link](std::size_t) { return link; });
+            converge(next, false);
+            return true;
+        }
+        case Kind::BRANCH:
+            branch(id, a, b, get_b_imm(inst));
+            return true;
+        case Kind::LOAD:
+            return load_lanes(rd, a, get_i_imm(inst), spec.size, spec.is_signed);
+        case Kind::STORE:
+            return store_lanes(a, b, get_s_imm(inst), spec.size);
+        case Kind::FENCE:
+            break;
+        default:
+            return false;
+        }
+
+        pc += 4;
+        return true;
+    }
+
+    // rd = op(a, b) for the ALU instruction id, on every lane
+    [[gnu::always_inline]] void alu(std::size_t id, std::size_t rd, const Row &a, const Row &b) {
+        // rd may be a or b, which the kernel doesn't expect
+        Row out;
+        alu_lanes<Lanes>(id, out.data(), a.data(), b.data(), std::make_index_sequence<inst_specs.size()>{});
+        regs[rd] = out;
+    }
+
+    [[gnu::always_inline]] void branch(std::size_t id, const Row &a, const Row &b, int64_t offset) {
+        Row cond;
+        alu_lanes<Lanes>(id, cond.data(), a.data(), b.data(), std::make_index_sequence<inst_specs.size()>{});
+        uint32_t taken = 0;
+        for (std::size_t lane = 0; lane < Lanes; lane++)
+            taken |= static_cast<uint32_t>(cond[lane] != 0) << lane;
+        taken &= active;
+
+        uint64_t target = pc + offset;
+        if (taken == active) {
+            pc = target;
+        } else if (taken == 0) {
+            pc += 4;
+        } else {
+            std::array<uint64_t, Lanes> next;
+            for (std::size_t lane = 0; lane < Lanes; lane++)
+                next[lane] = (taken >> lane) & 1 ? target : pc + 4;
+            converge(next, false);
+        }
+    }
+
+    // Only plain memory is handled here, the UART and faults are left to the scalar interpreter
+    [[gnu::always_inline]] bool in_memory(const std::array<uint64_t, Lanes> &addr, std::size_t size) const {
+        bool ok = true;
+        for_each_lane(active, [&](std::size_t lane) {
+            ok &= addr[lane] < mem_size && mem_size - addr[lane] >= size;
+        });
+        return ok;
+    }
+
+    [[gnu::always_inline]] bool load_lanes(std::size_t rd, const Row &base, int64_t offset, std::size_t size,
+            bool is_signed) {
+        std::array<uint64_t, Lanes> addr;
+        for (std::size_t lane = 0; lane < Lanes; lane++)
+            addr[lane] = base[lane] + offset;
+        if (!in_memory(addr, size))
+            return false;
+        if (rd == 0) {
+            pc += 4;
+            return true;
+        }
+
+        unsigned shift = 64 - 8 * size;
+        for_each_lane(active, [&](std::size_t lane) {
+            uint64_t value = 0;
+            std::memcpy(&value, cpus[lane]->memory->data() + addr[lane], size);
+            if (is_signed && size < 8)
+                value = static_cast<int64_t>(value << shift) >> shift;
+            regs[rd][lane] = value;
+        });
+
+        pc += 4;
+        return true;
+    }
+
+    [[gnu::always_inline]] bool store_lanes(const Row &base, const Row &value, int64_t offset, std::size_t size) {
+        std::array<uint64_t, Lanes> addr;
+        for (std::size_t lane = 0; lane < Lanes; lane++)
+            addr[lane] = base[lane] + offset;
+        if (!in_memory(addr, size))
+            return false;
+
+        for_each_lane(active, [&](std::size_t lane) {
+            Cpu &cpu = *cpus[lane];
+            std::memcpy(cpu.memory->data() + addr[lane], &value[lane], size);
+            cpu.mark_dirty(addr[lane], size);
+        });
+
+        pc += 4;
+        return true;
+    }
+
+    std::span<Cpu *const> cpus;
+    std::span<LaneOutcome> outcomes;
+    CpuConfig cfg;
+    const CpuVariant &variant;
+
+    alignas(64) std::array<Row, 32> regs{};
+    uint64_t pc{0};
+    uint32_t active{0};
+    // Lanes that left the group without stopping, to be finished on their own
+    uint32_t spilled{0};
+
+    // Instructions run by execute(), which lanes' budgets are only charged for when they are stored
+    uint64_t retired{0};
+    std::array<uint64_t, Lanes> charged{};
+    uint64_t limit{0};
+    // Every instruction the group started, for LaneOutcome::lockstep_retired
+    uint64_t group_retired{0};
+};
+
+/* Runs a group of up to lockstep_max_lanes Cpus. The loop running the lanes together is inlined into each clone,
+ * which the dynamic loader picks between by what the host supports, so that the loops over the lanes use AVX-512
+ * or AVX2 where they can without building for a particular host.
+ * */
+__attribute__((target_clones("avx512f", "avx2", "default")))
+void run_group(std::span<Cpu *const> cpus, std::span<LaneOutcome> outcomes, const CpuConfig &cfg,
+        const CpuVariant &variant) {
+    // Narrower groups for fewer lanes, so they don't pay for the unused ones
+    if (cpus.size() <= 4)
+        LockstepGroup<4>(cpus, outcomes, cfg, variant).run();
+    else if (cpus.size() <= 8)
+        LockstepGroup<8>(cpus, outcomes, cfg, variant).run();
+    else
+        LockstepGroup<16>(cpus, outcomes, cfg, variant).run();
+}
+
+}
+
+std::vector<LaneOutcome> run_lockstep(std::span<Cpu *const> cpus, const CpuConfig &cfg) {
+    auto variant = select_variant(cfg);
+    bool unsupported = std::ranges::any_of(cpus,
+            [](const Cpu *cpu) { return cpu->caches || cpu->tracer || cpu->multi_hart; });
+    if (!supports_lockstep(cfg) || variant == nullptr || unsupported)
+        throw std::runtime_error("lockstep execution isn't supported in this configuration");
+
+    std::vector<LaneOutcome> outcomes(cpus.size());
+    for (std::size_t bgn = 0; bgn < cpus.size(); bgn += lockstep_max_lanes) {
+        std::size_t count = std::min(lockstep_max_lanes, cpus.size() - bgn);
+        run_group(cpus.subspan(bgn, count), std::span(outcomes).subspan(bgn, count), cfg, *variant);
+    }
+    return outcomes;
+}
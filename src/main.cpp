@@ -7,22 +7,364 @@
 #include <algorithm>
 #include <optional>
 #include <cstdio>
+#include <string_view>
+#include <thread>
+#include <cstdlib>
+#include <cerrno>
 
 #include "cpu.hpp"
+#include "server.hpp"
+#include "aot.hpp"
+#include "lockstep.hpp"
+#include "scheduler.hpp"
 #include "util.hpp"
 
+static void usage(const char *name) {
+    std::cerr << "Usage: " << name << " [options] [instruction file]\n"
+        << "       " << name << " [options] --serve=SOCKET [--workers=N] [--pool=N]\n"
+        << "  --isa=ISA        rv64i, rv64ima, or rv64ima_zba_zbb_zbs (default)\n"
+        << "  --trace=LEVEL    0: silent, 1: ECALL register dumps (default), 2: every instruction\n"
+        << "  --stats          print execution statistics to stderr on exit\n"
+        << "  --unchecked      wrap out of bounds memory accesses instead of faulting\n"
+        << "  --multi-hart     track reservations across harts\n"
+        << "  --bin-trace=FILE write a binary trace of every instruction to FILE, see trace.hpp and\n"
+        << "                   riscv-trace-decode\n"
+        << "  --loop-idioms    run recognized copy and fill loops on the host all at once, see idiom.hpp\n"
+        << "  --lockstep=N     run N copies of the program in lockstep, see lockstep.hpp\n"
+        << "  --harts=N        run N harts sharing memory on --workers threads, see scheduler.hpp\n"
+        << "  --quantum=N      instructions a hart runs before the next one gets its turn (default: 10000)\n"
+        << "  --map=ADDR:FILE  map FILE read-only at guest address ADDR, above memory, see mapping.hpp\n"
+        << "  --map-private=ADDR:FILE\n"
+        << "                   map FILE copy on write, stores never reach the file\n"
+        << "  --aot            run natively compiled code where possible, see aot.hpp\n"
+        << "  --cache-sim      simulate caches and print per pc misses to stderr on exit\n"
+        << "  --l1i=SPEC, --l1d=SPEC, --l2=SPEC\n"
+        << "                   cache geometry as SIZE:WAYS:LINE[:lru|fifo|random], implies --cache-sim\n"
+        << "                   (defaults: 32k:8:64, 32k:8:64, 1m:16:64, all lru)\n"
+        << "  --serve=SOCKET   run jobs sent over a Unix domain socket, see server.hpp\n"
+        << "  --workers=N      number of threads serving connections or running harts (default: one per host\n"
+        << "                   thread)\n"
+        << "  --pool=N         number of pre-allocated emulator instances (default: twice the workers)\n";
+}
+
+struct MapSpec {
+    uint64_t base;
+    const char *path;
+    MapMode mode;
+};
+
+// Parses the ADDR:FILE of --map options, ADDR can be decimal or 0x prefixed hex
+static std::optional<MapSpec> parse_map(const char *spec, MapMode mode) {
+    char *end;
+    errno = 0;
+    uint64_t base = std::strtoull(spec, &end, 0);
+    if (end == spec || errno != 0 || *end != ':' || end[1] == '\0')
+        return std::nullopt;
+    return MapSpec {.base = base, .path = end + 1, .mode = mode};
+}
+
+// Returns false after reporting why if any of the files couldn't be mapped
+static bool map_files(Cpu &cpu, const std::vector<MapSpec> &maps) {
+    try {
+        for (const auto &map : maps)
+            cpu.map_file(map.path, map.base, map.mode);
+    } catch (const std::runtime_error &e) {
+        std::cerr << e.what() << "\n";
+        return false;
+    }
+    return true;
+}
+
+/* Runs `lanes` copies of the image loaded into first in lockstep, each started with its lane number in x10 like
+ * a hart id. Their UART output is printed in lane order once they all stopped, and the exit code is the first
+ * nonzero one of any lane.
+ * */
+static int run_lanes(Cpu &first, std::size_t image_size, std::size_t lanes, const std::vector<MapSpec> &maps,
+        const CpuConfig &cfg) {
+    std::vector<std::unique_ptr<Cpu>> copies;
+    std::vector<Cpu *> cpus{&first};
+    for (std::size_t lane = 1; lane < lanes; lane++) {
+        auto &cpu = *copies.emplace_back(std::make_unique<Cpu>());
+        std::copy_n(first.memory->begin(), image_size, cpu.memory->begin());
+        // Every lane gets its own mappings, private ones copy on write separately
+        if (!map_files(cpu, maps))
+            return 1;
+        cpus.push_back(&cpu);
+    }
+
+    std::vector<std::string> outputs(lanes);
+    for (std::size_t lane = 0; lane < lanes; lane++) {
+        cpus[lane]->registers[10] = lane;
+        cpus[lane]->uart.capture_output(&outputs[lane]);
+        cpus[lane]->uart.disable_input();
+    }
+
+    auto outcomes = run_lockstep(cpus, cfg);
+
+    int rc = 0;
+    for (std::size_t lane = 0; lane < lanes; lane++) {
+        cpus[lane]->uart.flush();
+        std::cout << outputs[lane];
+
+        const auto &outcome = outcomes[lane];
+        if (outcome.exit_code) {
+            std::cerr << std::format("lane {}: exited with {}, {} instructions in lockstep\n",
+                    lane, *outcome.exit_code, outcome.lockstep_retired);
+            if (rc == 0)
+                rc = *outcome.exit_code;
+        } else {
+            std::cerr << std::format("lane {}: {}, {} instructions in lockstep\n",
+                    lane, outcome.error, outcome.lockstep_retired);
+            if (rc == 0)
+                rc = 1;
+        }
+    }
+    return rc;
+}
+
+/* Runs `harts` harts on the image loaded into first with up to `workers` host threads, each started with its hart
+ * id in x10. The exit code is the first nonzero one of any hart.
+ * */
+static int run_harts(Cpu &first, std::size_t harts, unsigned workers, uint64_t quantum,
+        const std::vector<MapSpec> &maps, const CpuVariant &variant, const CpuConfig &cfg) {
+    std::vector<std::unique_ptr<Cpu>> copies;
+    std::vector<Cpu *> cpus{&first};
+    for (std::size_t worker = 1; worker < std::min<std::size_t>(workers, harts); worker++) {
+        auto &cpu = *copies.emplace_back(std::make_unique<Cpu>(first.memory));
+        // Only read-only mappings are allowed, so every worker mapping the file on its own sees the same data
+        if (!map_files(cpu, maps))
+            return 1;
+        cpus.push_back(&cpu);
+    }
+
+    int rc = 0;
+    try {
+        auto exit_codes = schedule_harts(cpus, variant.slice, harts, quantum);
+        for (std::size_t hart = 0; hart < harts; hart++) {
+            if (exit_codes[hart] != 0) {
+                std::cerr << std::format("hart {}: exited with {}\n", hart, exit_codes[hart]);
+                if (rc == 0)
+                    rc = exit_codes[hart];
+            }
+        }
+    } catch (const std::runtime_error &e) {
+        std::cerr << std::format("emulation stopped: {}\n", e.what());
+        rc = 1;
+    }
+
+    if (cfg.stats) {
+        for (const auto &copy : copies)
+            first.stats += copy->stats;
+        first.stats.dump(std::cerr);
+    }
+    return rc;
+}
+
+// Returns false on an unrecognized option
+static bool parse_option(std::string_view opt, CpuConfig &cfg) {
+    if (opt == "--isa=rv64i") {
+        cfg.ext_m = cfg.ext_a = cfg.ext_b = false;
+    } else if (opt == "--isa=rv64ima") {
+        cfg.ext_m = cfg.ext_a = true;
+        cfg.ext_b = false;
+    } else if (opt == "--isa=rv64ima_zba_zbb_zbs") {
+        cfg.ext_m = cfg.ext_a = cfg.ext_b = true;
+    } else if (opt.starts_with("--trace=") && opt.size() == 9 && opt[8] >= '0' && opt[8] <= '2') {
+        cfg.trace = opt[8] - '0';
+    } else if (opt == "--stats") {
+        cfg.stats = true;
+    } else if (opt == "--unchecked") {
+        cfg.checked_mem = false;
+    } else {
+        return false;
+    }
+    return true;
+}
+
 int main(int argc, char **argv) {
-    if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " [instruction file]\n";
+    CpuConfig cfg{};
+    const char *path = nullptr;
+    const char *socket_path = nullptr;
+    unsigned workers = std::max(1u, std::thread::hardware_concurrency());
+    std::size_t pool_size = 0;
+    bool aot = false;
+    bool loop_idioms = false;
+    std::size_t lanes = 0;
+    std::size_t harts = 0;
+    uint64_t quantum = 10000;
+    std::vector<MapSpec> maps;
+    const char *bin_trace_path = nullptr;
+    bool cache_sim = false;
+    bool multi_hart = false;
+    CacheLevelConfig l1i_cfg = default_l1i, l1d_cfg = default_l1d, l2_cfg = default_l2;
+
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (arg.starts_with("--l1i=") || arg.starts_with("--l1d=") || arg.starts_with("--l2=")) {
+            auto parsed = parse_cache_level(arg.substr(arg.find('=') + 1));
+            if (!parsed) {
+                usage(argv[0]);
+                return 1;
+            }
+            (arg[4] == 'i' ? l1i_cfg : arg[4] == 'd' ? l1d_cfg : l2_cfg) = *parsed;
+            cache_sim = true;
+        } else if (arg == "--cache-sim") {
+            cache_sim = true;
+        } else if (arg == "--multi-hart") {
+            multi_hart = true;
+        } else if (arg.starts_with("--bin-trace=") && arg.size() > 12) {
+            bin_trace_path = argv[i] + 12;
+        } else if (arg == "--loop-idioms") {
+            loop_idioms = true;
+        } else if (arg.starts_with("--lockstep=")) {
+            lanes = std::atoi(argv[i] + 11);
+            if (lanes == 0) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg.starts_with("--harts=")) {
+            harts = std::atoi(argv[i] + 8);
+            if (harts == 0) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg.starts_with("--quantum=")) {
+            quantum = std::strtoull(argv[i] + 10, nullptr, 0);
+            if (quantum == 0) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg.starts_with("--map=") || arg.starts_with("--map-private=")) {
+            bool is_private = arg.starts_with("--map-private=");
+            auto map = parse_map(argv[i] + (is_private ? 14 : 6),
+                    is_private ? MapMode::PRIVATE : MapMode::READ_ONLY);
+            if (!map) {
+                usage(argv[0]);
+                return 1;
+            }
+            maps.push_back(*map);
+        } else if (arg == "--aot") {
+            aot = true;
+        } else if (arg.starts_with("--serve=")) {
+            socket_path = argv[i] + 8;
+        } else if (arg.starts_with("--workers=")) {
+            workers = std::atoi(argv[i] + 10);
+            if (workers == 0) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg.starts_with("--pool=")) {
+            pool_size = std::atoi(argv[i] + 7);
+            if (pool_size == 0) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg.starts_with("--")) {
+            if (!parse_option(arg, cfg)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (path == nullptr) {
+            path = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // Jobs report their statistics to the client, and there is nobody to read a trace or a cache report. They
+    // run a single hart each, so they don't need reservations either.
+    if (socket_path != nullptr) {
+        cfg.trace = 0;
+        cfg.stats = true;
+        cache_sim = false;
+        bin_trace_path = nullptr;
+        multi_hart = false;
+    }
+    // Attached to the Cpu rather than built into the interpreter, see CpuConfig
+    bool observers = cache_sim || bin_trace_path != nullptr;
+
+    if ((path == nullptr) == (socket_path == nullptr)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Native code would silently skip over all of these
+    if (aot && (socket_path != nullptr || cfg.trace >= 2 || cfg.stats || observers)) {
+        std::cerr << "--aot can't be combined with --serve, --trace=2, --stats, --bin-trace, or cache simulation\n";
+        return 1;
+    }
+
+    if (loop_idioms && (socket_path != nullptr || observers || multi_hart || !supports_loop_idioms(cfg))) {
+        std::cerr << "--loop-idioms can't be combined with --serve, --trace=2, --stats, --multi-hart, --bin-trace, "
+            "or cache simulation\n";
         return 1;
     }
 
+    // Clients of the server don't get to pick host files
+    if (!maps.empty() && socket_path != nullptr) {
+        std::cerr << "--map can't be combined with --serve\n";
+        return 1;
+    }
+
+    if (lanes != 0 && (socket_path != nullptr || aot || loop_idioms || observers || multi_hart
+                || !supports_lockstep(cfg))) {
+        std::cerr << "--lockstep can't be combined with --serve, --aot, --loop-idioms, --trace=2, --stats, "
+            "--multi-hart, --bin-trace, or cache simulation\n";
+        return 1;
+    }
+
+    // Workers share memory, but everything else of a Cpu is their own
+    bool private_maps = std::any_of(maps.begin(), maps.end(),
+            [](const MapSpec &map) { return map.mode == MapMode::PRIVATE; });
+    if (harts != 0 && (socket_path != nullptr || aot || loop_idioms || lanes != 0 || multi_hart || observers
+                || private_maps)) {
+        std::cerr << "--harts can't be combined with --serve, --aot, --loop-idioms, --lockstep, --multi-hart, "
+            "--bin-trace, --map-private, or cache simulation\n";
+        return 1;
+    }
+
+    // Only the variants with statistics check for the observers
+    CpuConfig built = cfg;
+    built.stats = cfg.stats || observers;
+    auto variant = select_variant(built);
+    if (variant == nullptr) {
+        std::cerr << "no variant of the emulator was built for this configuration\n";
+        return 1;
+    }
+
+    if (socket_path != nullptr)
+        return serve(socket_path, workers, pool_size != 0 ? pool_size : 2 * workers, variant->run);
+
     Cpu cpu{};
+    cpu.multi_hart = multi_hart;
+
+    if (cache_sim) {
+        try {
+            cpu.caches = std::make_unique<CacheHierarchy>(l1i_cfg, l1d_cfg, l2_cfg);
+        } catch (const std::runtime_error &e) {
+            std::cerr << e.what() << "\n";
+            return 1;
+        }
+    }
+    if (loop_idioms)
+        cpu.idioms = std::make_unique<LoopIdiomCache>();
+    if (!map_files(cpu, maps))
+        return 1;
+    if (bin_trace_path != nullptr) {
+        try {
+            cpu.tracer = std::make_unique<TraceWriter>(bin_trace_path);
+        } catch (const std::runtime_error &e) {
+            std::cerr << e.what() << "\n";
+            return 1;
+        }
+    }
+    std::size_t image_size = 0;
 
     // Loads instructions into memory from user supplied file
     {
         std::unique_ptr<FILE, void (*)(FILE *)> instruction_file{
-            fopen(argv[1], "rb"),
+            fopen(path, "rb"),
             [](FILE *f) { 
                 if (f != nullptr && fclose(f) == EOF) {
                     perror("error while closing instruction file");
@@ -43,8 +385,10 @@ int main(int argc, char **argv) {
                 std::cerr << "instruction file overflows memory, terminating...\n";
                 return 1;
             }
-            std::cout << cnt << "\n";
+            if (cfg.trace >= 2)
+                std::cout << cnt << "\n";
             std::copy_n(inst_buf.cbegin(), cnt, cpu.memory->begin() + ind);
+            image_size = ind + cnt;
         }
 
         if (ferror(&*instruction_file)) {
@@ -52,99 +396,34 @@ int main(int argc, char **argv) {
             return 1;
         }
     }
-    
-    // Fetch decode execute
-    {
-        for (;; cpu.pc += 4) {
-            if (cpu.pc >= mem_size) {
-                std::cerr << "invalid pc value: " << cpu.pc << "\n";
-                return 1;
-            }
 
-            // fetch
-            dword_u inst_bytes{};
-            inst_bytes.bytes[0] = (*cpu.memory)[cpu.pc];
-            inst_bytes.bytes[1] = (*cpu.memory)[cpu.pc+1];
-            inst_bytes.bytes[2] = (*cpu.memory)[cpu.pc+2];
-            inst_bytes.bytes[3] = (*cpu.memory)[cpu.pc+3];
-            auto inst = inst_bytes.dword;
+    if (lanes != 0)
+        return run_lanes(cpu, image_size, lanes, maps, cfg);
+    if (harts != 0)
+        return run_harts(cpu, harts, workers, quantum, maps, *variant, cfg);
 
-            std::cout << std::format("fetched: 0x{:08x} @ 0x{:08x}\n", inst, cpu.pc);
-
-            if (inst == 0) {
-                cpu.dump_regs();
-                std::cerr << "invalid instruction at: 0x" << std::hex << cpu.pc << "\t\tvalue: " << inst << "\n";
-                return 1;
-            }
-
-            // decode
-            uint8_t opcode = inst & 0x7f;
-            std::size_t rd = (inst >> 7) & 0x1f;
-            std::size_t rs1 = (inst >> 15) & 0x1f;
-            int32_t offset;
-
-            // execute
-            switch (opcode) {
-            case OP_OP_IMM: {
-                handle_op_im(inst, cpu);
-                break;
-            }
-            case OP_OP: {
-                handle_op_op(inst, cpu);
-                break;
-            }
-            case OP_OP_IMM_32: {
-                handle_op_im_32(inst, cpu);
-                break;
-            }
-            case OP_LUI: {
-                cpu.registers[rd] = inst & 0xfffff000;
-                break;
-            }
-            case OP_AUIPC: {
-                cpu.registers[rd] = (inst & 0xfffff000) + cpu.pc;
-                break;
-            }
-            // TODO: Generate address misaligned exceptions for jump instructions
-            case OP_JAL: {
-                offset = get_j_imm(inst);
-                if (rd != 0)
-                    cpu.registers[rd] = cpu.pc + 4;
-                cpu.pc += offset - 4;
-                break;
-            }
-            case OP_JALR: {
-                offset = get_i_imm(inst);
-                if (rd != 0)
-                    cpu.registers[rd] = cpu.pc + 4;
-                cpu.registers[rs1] = (cpu.registers[rs1] + offset) & ~1;
-                break;
-            }
-            case OP_BRANCH: {
-                handle_op_branch(inst, cpu);
-                break;
-            }
-            case OP_LOAD: {
-                handle_op_load(inst, cpu);
-                break;
-            }
-            case OP_STORE: {
-                handle_op_store(inst, cpu);
-                break;
-            }
-            case OP_SYSTEM: {
-                auto rc = handle_op_system(inst, cpu);
-                if (rc)
-                    return rc.value();
-                break;
-            }
-            case OP_AMO: {
-                handle_op_amo(inst, cpu);
-                break;
-            }
-            // FENCE (opcode=OP_MISC_MEM + funct3=FENCE) is handled as a noop
-            // No hints are defined (for now atleast)
-            }
+    std::unique_ptr<AotModule> aot_module;
+    if (aot) {
+        try {
+            aot_module = std::make_unique<AotModule>(cpu, image_size, cfg);
+        } catch (const std::exception &e) {
+            std::cerr << e.what() << "\n";
+            return 1;
         }
     }
+
+    int rc;
+    try {
+        rc = aot_module ? aot_module->run(cpu, variant->step) : variant->run(cpu);
+    } catch (const std::runtime_error &e) {
+        std::cerr << std::format("emulation stopped @ 0x{:08x}: {}\n", cpu.pc, e.what());
+        rc = 1;
+    }
+
+    if (cfg.stats)
+        cpu.stats.dump(std::cerr);
+    if (cache_sim)
+        cpu.caches->report(std::cerr, 32, *cpu.memory);
+
+    return rc;
 }
@@ -0,0 +1,63 @@
+#include <cstdio>
+#include <format>
+#include <stdexcept>
+#include <utility>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mapping.hpp"
+
+FileMapping::FileMapping(const char *path, uint64_t base, MapMode mode) : guest_base(base), mode(mode) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("error while opening mapped file");
+        throw std::runtime_error(std::format("can't open mapped file {}", path));
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("error while reading mapped file");
+        close(fd);
+        throw std::runtime_error(std::format("can't stat mapped file {}", path));
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        throw std::runtime_error(std::format("{} isn't a non-empty regular file", path));
+    }
+    length = st.st_size;
+
+    // Private mappings can be written to through a read-only descriptor, the file is never touched. The mapping
+    // keeps the file open on its own.
+    int prot = mode == MapMode::PRIVATE ? PROT_READ | PROT_WRITE : PROT_READ;
+    void *mapped = mmap(nullptr, length, prot, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        perror("error while mapping file");
+        throw std::runtime_error(std::format("can't map file {}", path));
+    }
+    host = static_cast<uint8_t *>(mapped);
+}
+
+FileMapping::~FileMapping() {
+    if (host != nullptr && munmap(host, length) != 0)
+        perror("error while unmapping file");
+}
+
+FileMapping::FileMapping(FileMapping &&other) noexcept
+    : host(std::exchange(other.host, nullptr)), guest_base(other.guest_base), length(other.length),
+      mode(other.mode) {}
+
+FileMapping &FileMapping::operator=(FileMapping &&other) noexcept {
+    if (this != &other) {
+        if (host != nullptr)
+            munmap(host, length);
+        host = std::exchange(other.host, nullptr);
+        guest_base = other.guest_base;
+        length = other.length;
+        mode = other.mode;
+    }
+    return *this;
+}
@@ -0,0 +1,239 @@
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <format>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "scheduler.hpp"
+
+namespace {
+
+// Everything about a hart that lives in the Cpu while it runs
+struct Hart {
+    std::array<int64_t, 32> registers{};
+    uint64_t pc{program_bgn};
+    HartContext context{};
+    std::optional<int> exit_code{};
+};
+
+// Ready harts of one worker, by index. The owner takes them from the front, thieves from the back.
+class RunQueue {
+public:
+    void push(std::size_t hart) {
+        std::lock_guard lock{mutex};
+        harts.push_back(hart);
+    }
+
+    std::optional<std::size_t> pop() {
+        std::lock_guard lock{mutex};
+        if (harts.empty())
+            return std::nullopt;
+        std::size_t hart = harts.front();
+        harts.pop_front();
+        return hart;
+    }
+
+    std::optional<std::size_t> steal() {
+        std::lock_guard lock{mutex};
+        if (harts.empty())
+            return std::nullopt;
+        std::size_t hart = harts.back();
+        harts.pop_back();
+        return hart;
+    }
+
+private:
+    std::mutex mutex;
+    std::deque<std::size_t> harts;
+};
+
+class HartScheduler {
+public:
+    HartScheduler(std::span<Cpu *const> cpus, step_fn run_slice, std::size_t hart_count, uint64_t quantum)
+        : cpus{cpus}, run_slice{run_slice}, quantum{quantum}, harts(hart_count), queues(cpus.size()),
+          ready{hart_count}, live{hart_count} {
+        for (std::size_t hart = 0; hart < hart_count; hart++) {
+            harts[hart].pc = cpus[0]->pc;
+            harts[hart].registers[10] = hart;
+            queues[hart % queues.size()].push(hart);
+        }
+    }
+
+    std::vector<int> run() {
+        std::vector<std::thread> threads;
+        for (std::size_t worker = 1; worker < cpus.size(); worker++)
+            threads.emplace_back(&HartScheduler::work, this, worker);
+        work(0);
+        for (auto &thread : threads)
+            thread.join();
+
+        if (error)
+            throw std::runtime_error(*error);
+
+        std::vector<int> exit_codes;
+        for (const auto &hart : harts)
+            exit_codes.push_back(*hart.exit_code);
+        return exit_codes;
+    }
+
+private:
+    void work(std::size_t worker) {
+        Cpu &cpu = *cpus[worker];
+        while (auto next = take(worker)) {
+            Hart &hart = harts[*next];
+            uint64_t epoch = wake_epoch.load();
+
+            cpu.registers = hart.registers;
+            cpu.pc = hart.pc;
+            cpu.contexts[cpu.cur_hart] = hart.context;
+            cpu.slice = quantum;
+            cpu.waiting = false;
+            cpu.wake_events = 0;
+
+            std::optional<int> rc;
+            try {
+                rc = run_slice(cpu);
+            } catch (const std::exception &e) {
+                fail(std::format("hart {} stopped @ 0x{:08x}: {}", *next, cpu.pc, e.what()));
+                return;
+            }
+
+            hart.registers = cpu.registers;
+            hart.pc = cpu.pc;
+            hart.context = cpu.contexts[cpu.cur_hart];
+            // Keeps the output of harts on different workers roughly in the order it was written
+            cpu.uart.flush();
+
+            if (cpu.wake_events != 0)
+                wake(worker);
+            if (rc)
+                finish(hart, *rc);
+            else if (cpu.waiting)
+                sleep(worker, *next, epoch);
+            else
+                requeue(worker, *next);
+        }
+    }
+
+    // The next hart for worker to run, or nothing once the machine stopped
+    std::optional<std::size_t> take(std::size_t worker) {
+        for (;;) {
+            if (stopping.load())
+                return std::nullopt;
+            if (auto hart = queues[worker].pop()) {
+                ready--;
+                return hart;
+            }
+            for (std::size_t i = 1; i < queues.size(); i++) {
+                if (auto hart = queues[(worker + i) % queues.size()].steal()) {
+                    ready--;
+                    return hart;
+                }
+            }
+
+            std::unique_lock lock{mutex};
+            if (live == 0 || stopping.load())
+                return std::nullopt;
+            // With every other worker idle as well, nothing is left that could wake the sleeping harts
+            if (!asleep.empty() && idle + 1 == queues.size()) {
+                wake_locked(worker);
+                continue;
+            }
+            idle++;
+            cv.wait(lock, [this] { return ready.load() != 0 || live == 0 || stopping.load(); });
+            idle--;
+        }
+    }
+
+    void requeue(std::size_t worker, std::size_t hart) {
+        // Counted first, so that ready never drops below the harts actually in the queues
+        ready++;
+        queues[worker].push(hart);
+        if (idle.load() != 0) {
+            // Idle workers check ready with the mutex held, so they either see the hart or get notified
+            { std::lock_guard lock{mutex}; }
+            cv.notify_one();
+        }
+    }
+
+    void sleep(std::size_t worker, std::size_t hart, uint64_t epoch) {
+        {
+            std::lock_guard lock{mutex};
+            // Whatever the hart waits for may already have happened while it was running
+            if (wake_epoch.load() == epoch) {
+                asleep.push_back(hart);
+                return;
+            }
+        }
+        requeue(worker, hart);
+    }
+
+    void wake(std::size_t worker) {
+        std::lock_guard lock{mutex};
+        wake_epoch++;
+        wake_locked(worker);
+    }
+
+    // Moves every sleeping hart to worker's queue, the mutex must be held
+    void wake_locked(std::size_t worker) {
+        if (asleep.empty())
+            return;
+        ready += asleep.size();
+        for (auto hart : asleep)
+            queues[worker].push(hart);
+        asleep.clear();
+        cv.notify_all();
+    }
+
+    void finish(Hart &hart, int rc) {
+        hart.exit_code = rc;
+        std::lock_guard lock{mutex};
+        if (--live == 0)
+            cv.notify_all();
+    }
+
+    void fail(std::string message) {
+        std::lock_guard lock{mutex};
+        if (!error)
+            error = std::move(message);
+        stopping = true;
+        cv.notify_all();
+    }
+
+    std::span<Cpu *const> cpus;
+    step_fn run_slice;
+    uint64_t quantum;
+    std::vector<Hart> harts;
+    std::vector<RunQueue> queues;
+    // Harts in the queues, read without the mutex to tell whether there's anything to steal
+    std::atomic<std::size_t> ready;
+    // Workers waiting for harts, only written with the mutex held
+    std::atomic<std::size_t> idle{0};
+    std::atomic<bool> stopping{false};
+    // Bumped whenever sleeping harts are woken, only written with the mutex held
+    std::atomic<uint64_t> wake_epoch{0};
+
+    // Guards everything below, and the waits of idle workers
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<std::size_t> asleep;
+    // Harts that haven't exited
+    std::size_t live;
+    std::optional<std::string> error;
+};
+
+}
+
+std::vector<int> schedule_harts(std::span<Cpu *const> cpus, step_fn run_slice, std::size_t harts, uint64_t quantum) {
+    if (cpus.empty() || harts == 0 || quantum == 0)
+        throw std::runtime_error("the scheduler needs at least one worker, one hart, and a nonzero quantum");
+    for (auto cpu : cpus.subspan(1))
+        cpu->memory = cpus[0]->memory;
+    return HartScheduler{cpus, run_slice, harts, quantum}.run();
+}
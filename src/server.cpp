@@ -0,0 +1,296 @@
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <string>
+#include <format>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "server.hpp"
+
+struct Instance {
+    Cpu cpu{};
+    // Guest UART output of the current job
+    std::string output{};
+
+    Instance() {
+        cpu.uart.capture_output(&output, server_max_output);
+        cpu.uart.disable_input();
+    }
+};
+
+/* Instances ready to take a job. Used ones are reset by a background thread before they go back to the pool,
+ * so clearing memory usually doesn't sit between a request and its response. That thread runs at idle priority
+ * and may not get to run on a loaded host, so a worker that finds no clean instance resets one itself.
+ * */
+class InstancePool {
+public:
+    explicit InstancePool(std::size_t size) {
+        for (std::size_t i = 0; i < size; i++)
+            dirty.push_back(std::make_unique<Instance>());
+    }
+
+    std::unique_ptr<Instance> acquire() {
+        std::unique_lock lock{mutex};
+        clean_cv.wait(lock, [this] { return !clean.empty() || !dirty.empty(); });
+        if (!clean.empty()) {
+            auto inst = std::move(clean.back());
+            clean.pop_back();
+            return inst;
+        }
+
+        auto inst = std::move(dirty.back());
+        dirty.pop_back();
+        lock.unlock();
+        clear(*inst);
+        return inst;
+    }
+
+    void release(std::unique_ptr<Instance> inst) {
+        {
+            std::lock_guard lock{mutex};
+            dirty.push_back(std::move(inst));
+        }
+        dirty_cv.notify_one();
+        // Workers waiting in acquire() can take it as well
+        clean_cv.notify_one();
+    }
+
+    // Runs until stop(). The first pass over the pool faults in every page of every instance.
+    void reset_loop() {
+        // Resets are never urgent while the pool has clean instances, they shouldn't delay the clients reading
+        // responses or the workers running jobs
+        sched_param param{};
+        pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+        for (;;) {
+            std::unique_ptr<Instance> inst;
+            {
+                std::unique_lock lock{mutex};
+                dirty_cv.wait(lock, [this] { return stopping || !dirty.empty(); });
+                if (stopping)
+                    return;
+                inst = std::move(dirty.back());
+                dirty.pop_back();
+            }
+
+            clear(*inst);
+
+            {
+                std::lock_guard lock{mutex};
+                clean.push_back(std::move(inst));
+            }
+            clean_cv.notify_one();
+        }
+    }
+
+    void stop() {
+        {
+            std::lock_guard lock{mutex};
+            stopping = true;
+        }
+        dirty_cv.notify_all();
+    }
+
+private:
+    static void clear(Instance &inst) {
+        inst.cpu.reset();
+        inst.output.clear();
+    }
+
+    bool stopping{false};
+    std::mutex mutex;
+    std::condition_variable clean_cv, dirty_cv;
+    std::vector<std::unique_ptr<Instance>> clean, dirty;
+};
+
+// Both return false once the peer is gone
+static bool read_all(int fd, void *buf, std::size_t size) {
+    auto *bytes = static_cast<uint8_t *>(buf);
+    while (size > 0) {
+        auto cnt = ::read(fd, bytes, size);
+        if (cnt < 0 && errno == EINTR)
+            continue;
+        if (cnt <= 0)
+            return false;
+        bytes += cnt;
+        size -= cnt;
+    }
+    return true;
+}
+
+static bool write_all(int fd, const void *buf, std::size_t size) {
+    auto *bytes = static_cast<const uint8_t *>(buf);
+    while (size > 0) {
+        auto cnt = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (cnt < 0 && errno == EINTR)
+            continue;
+        if (cnt <= 0)
+            return false;
+        bytes += cnt;
+        size -= cnt;
+    }
+    return true;
+}
+
+// Copies a flat binary from the server's filesystem to the start of memory
+static std::string load_path(Cpu &cpu, const std::string &path) {
+    std::unique_ptr<FILE, int (*)(FILE *)> file{fopen(path.c_str(), "rb"), fclose};
+    if (file == nullptr)
+        return std::format("error while opening {}: {}", path, strerror(errno));
+
+    std::size_t size = fread(cpu.memory->data() + program_bgn, 1, mem_size - program_bgn, &*file);
+    if (ferror(&*file))
+        return std::format("error while reading {}: {}", path, strerror(errno));
+    if (size == mem_size - program_bgn && fgetc(&*file) != EOF)
+        return std::format("{} overflows memory", path);
+    if (size != 0)
+        cpu.mark_dirty(program_bgn, size);
+
+    return {};
+}
+
+// Runs a single job. Returns false if the connection should be dropped.
+static bool handle_job(int conn, const ServerRequest &req, Instance &inst, run_fn run_variant) {
+    Cpu &cpu = inst.cpu;
+    std::string &output = inst.output;
+
+    ServerResponse resp{};
+    std::string message;
+
+    if (req.kind == JOB_PATH && req.length <= server_max_path) {
+        std::string path(req.length, '\0');
+        if (!read_all(conn, path.data(), path.size()))
+            return false;
+        message = load_path(cpu, path);
+    } else if (req.kind == JOB_IMAGE && req.length <= mem_size - program_bgn) {
+        if (req.length != 0)
+            cpu.mark_dirty(program_bgn, req.length);
+        if (!read_all(conn, cpu.memory->data() + program_bgn, req.length))
+            return false;
+    } else {
+        // The payload can't be skipped safely, so the connection goes too
+        message = "malformed request";
+        resp.status = STATUS_BAD_REQUEST;
+        resp.message_length = message.size();
+        write_all(conn, &resp, sizeof(resp));
+        write_all(conn, message.data(), message.size());
+        return false;
+    }
+
+    if (!message.empty()) {
+        resp.status = STATUS_BAD_REQUEST;
+    } else {
+        if (req.budget != 0)
+            cpu.budget = req.budget;
+
+        try {
+            resp.exit_code = run_variant(cpu);
+            resp.status = STATUS_EXITED;
+        } catch (const BudgetExhausted &) {
+            resp.status = STATUS_BUDGET_EXHAUSTED;
+        } catch (const std::runtime_error &e) {
+            resp.status = STATUS_FAULT;
+            message = std::format("emulation stopped @ 0x{:08x}: {}", cpu.pc, e.what());
+        }
+        cpu.uart.flush();
+    }
+
+    resp.retired = cpu.stats.retired;
+    resp.branches_taken = cpu.stats.branches_taken;
+    resp.output_length = output.size();
+    resp.output_dropped = cpu.uart.dropped_output();
+    resp.message_length = message.size();
+
+    return write_all(conn, &resp, sizeof(resp))
+        && write_all(conn, output.data(), output.size())
+        && write_all(conn, message.data(), message.size());
+}
+
+static void worker(int listen_fd, InstancePool &pool, run_fn run_variant) {
+    for (;;) {
+        int conn = accept(listen_fd, nullptr, nullptr);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("error while accepting connection");
+            return;
+        }
+
+        ServerRequest req;
+        while (read_all(conn, &req, sizeof(req)) && req.magic == server_magic) {
+            // Only taken once the request is in, idle connections don't hold on to instances
+            auto inst = pool.acquire();
+            bool keep = handle_job(conn, req, *inst, run_variant);
+            pool.release(std::move(inst));
+            if (!keep)
+                break;
+        }
+
+        close(conn);
+    }
+}
+
+int serve(const char *socket_path, unsigned workers, std::size_t pool_size, run_fn run_variant) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        std::cerr << "socket path is too long\n";
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        perror("error while creating socket");
+        return 1;
+    }
+
+    // Only a socket left behind by an earlier run is replaced, anything else at the path is the user's
+    struct stat st{};
+    if (lstat(socket_path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            std::cerr << std::format("{} exists and isn't a socket\n", socket_path);
+            close(listen_fd);
+            return 1;
+        }
+        unlink(socket_path);
+    }
+    if (bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+        perror("error while binding socket");
+        close(listen_fd);
+        return 1;
+    }
+
+    if (listen(listen_fd, SOMAXCONN) < 0) {
+        perror("error while listening on socket");
+        close(listen_fd);
+        return 1;
+    }
+
+    InstancePool pool{pool_size};
+    std::thread resetter{&InstancePool::reset_loop, &pool};
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < workers; i++)
+        threads.emplace_back(worker, listen_fd, std::ref(pool), run_variant);
+
+    // Workers only stop if accept() fails, at which point the socket is unusable for everyone
+    for (auto &thread : threads)
+        thread.join();
+    pool.stop();
+    resetter.join();
+    close(listen_fd);
+    return 1;
+}
@@ -0,0 +1,138 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <format>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "trace.hpp"
+
+// Writes all of buf, retrying short and interrupted writes. Returns false on error.
+static bool write_all(int fd, const uint8_t *buf, std::size_t size) {
+    while (size != 0) {
+        ssize_t written = write(fd, buf, size);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buf += written;
+        size -= written;
+    }
+    return true;
+}
+
+TraceWriter::TraceWriter(const char *path) {
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("error while opening trace file");
+        throw std::runtime_error(std::format("can't open trace file {}", path));
+    }
+
+    uint8_t header[16];
+    std::memcpy(header, trace_magic.data(), trace_magic.size());
+    for (std::size_t i = 0; i < 8; i++)
+        header[8 + i] = trace_keyframe_interval >> (8 * i);
+    if (!write_all(fd, header, sizeof(header))) {
+        perror("error while writing trace file");
+        close(fd);
+        throw std::runtime_error(std::format("can't write trace file {}", path));
+    }
+
+    drainer = std::thread([this] { drain_loop(); });
+}
+
+TraceWriter::~TraceWriter() {
+    flush_stage();
+    stopping.store(true, std::memory_order_release);
+    doorbell.fetch_add(1, std::memory_order_release);
+    doorbell.notify_one();
+    drainer.join();
+
+    if (close(fd) != 0)
+        perror("error while closing trace file");
+}
+
+void TraceWriter::keyframe(uint64_t pc, const int64_t *registers, const uint8_t *memory) {
+    uint8_t *out = stage.get() + staged;
+    *out++ = TRACE_KEYFRAME;
+    out = put_uleb(out, retired);
+    out = put_uleb(out, pc);
+    for (std::size_t reg = 1; reg < 32; reg++) {
+        for (std::size_t i = 0; i < 8; i++)
+            *out++ = static_cast<uint64_t>(registers[reg]) >> (8 * i);
+    }
+    out = put_uleb(out, written_pages.size());
+    next_pc = pc;
+    staged = out - stage.get();
+
+    std::sort(written_pages.begin(), written_pages.end());
+    for (auto page : written_pages) {
+        staged = put_uleb(stage.get() + staged, page) - stage.get();
+        flush_stage();
+        push(memory + page * trace_page_size, trace_page_size);
+        page_written[page] = false;
+    }
+    written_pages.clear();
+}
+
+void TraceWriter::flush_stage() {
+    push(stage.get(), staged);
+    staged = 0;
+}
+
+// Copies src into the ring, waiting for the drain thread whenever the ring is full
+void TraceWriter::push(const uint8_t *src, std::size_t size) {
+    std::size_t left = size;
+    std::size_t h = head.load(std::memory_order_relaxed);
+
+    while (left != 0) {
+        std::size_t t = tail.load(std::memory_order_acquire);
+        if (h - t == ring_size) {
+            tail.wait(t, std::memory_order_acquire);
+            continue;
+        }
+
+        std::size_t offset = h % ring_size;
+        std::size_t chunk = std::min({left, ring_size - (h - t), ring_size - offset});
+        std::memcpy(&ring[offset], src, chunk);
+        src += chunk;
+        left -= chunk;
+        h += chunk;
+        head.store(h, std::memory_order_release);
+        doorbell.fetch_add(1, std::memory_order_release);
+        doorbell.notify_one();
+    }
+}
+
+void TraceWriter::drain_loop() {
+    std::size_t t = tail.load(std::memory_order_relaxed);
+    bool failed = false;
+
+    for (;;) {
+        // Read before checking for work, so that a ring after the check makes the wait return right away
+        uint32_t bell = doorbell.load(std::memory_order_acquire);
+        std::size_t h = head.load(std::memory_order_acquire);
+        if (h == t) {
+            // head is final once stopping is set, but h may predate it
+            if (stopping.load(std::memory_order_acquire) && head.load(std::memory_order_acquire) == t)
+                return;
+            doorbell.wait(bell, std::memory_order_acquire);
+            continue;
+        }
+
+        // Up to the end of the ring, the rest is picked up on the next iteration
+        std::size_t offset = t % ring_size;
+        std::size_t chunk = std::min(h - t, ring_size - offset);
+        if (!failed && !write_all(fd, &ring[offset], chunk)) {
+            perror("error while writing trace file");
+            // Keep consuming so that the interpreter never blocks on a dead file
+            failed = true;
+        }
+        t += chunk;
+        tail.store(t, std::memory_order_release);
+        tail.notify_one();
+    }
+}
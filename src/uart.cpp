@@ -0,0 +1,200 @@
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cerrno>
+#include <iostream>
+#include <stdexcept>
+
+#include <poll.h>
+#include <unistd.h>
+
+#include "uart.hpp"
+
+enum uart_regs {
+    RBR_THR_DLL = 0,
+    IER_DLM = 1,
+    IIR_FCR = 2,
+    LCR = 3,
+    MCR = 4,
+    LSR = 5,
+    MSR = 6,
+    SCR = 7,
+};
+
+enum lsr_bits {
+    LSR_DR = 1 << 0,
+    LSR_THRE = 1 << 5,
+    LSR_TEMT = 1 << 6,
+};
+
+constexpr uint8_t lcr_dlab = 1 << 7;
+constexpr uint8_t fcr_enable = 1 << 0;
+constexpr uint8_t fcr_clear_rx = 1 << 1;
+
+Uart::Uart() {
+    out_buf.reserve(uart_out_buf_size);
+}
+
+Uart::~Uart() {
+    flush();
+}
+
+uint8_t Uart::read(std::size_t offset) {
+    bool dlab = lcr & lcr_dlab;
+
+    switch (offset) {
+    case RBR_THR_DLL: {
+        if (dlab)
+            return dll;
+
+        // A guest reading input is probably about to wait on it, so whatever it printed as a prompt has to be
+        // visible first
+        flush();
+        if (in_buf.empty())
+            poll_input();
+        if (in_buf.empty())
+            return 0;
+
+        uint8_t byte = in_buf.front();
+        in_buf.pop_front();
+        return byte;
+    }
+    case IER_DLM:
+        return dlab ? dlm : ier;
+    case IIR_FCR:
+        // No interrupt pending, FIFO enabled bits mirror FCR
+        return (fcr & fcr_enable) ? 0xc1 : 0x01;
+    case LCR:
+        return lcr;
+    case MCR:
+        return mcr;
+    case LSR: {
+        if (in_buf.empty() && ++polls_skipped >= poll_interval)
+            poll_input();
+        return LSR_THRE | LSR_TEMT | (in_buf.empty() ? 0 : LSR_DR);
+    }
+    case MSR:
+        return 0;
+    case SCR:
+        return scr;
+    }
+
+    return 0;
+}
+
+void Uart::write(std::size_t offset, uint8_t value) {
+    bool dlab = lcr & lcr_dlab;
+
+    switch (offset) {
+    case RBR_THR_DLL: {
+        if (dlab) {
+            dll = value;
+            break;
+        }
+
+        out_buf.push_back(value);
+        if (out_buf.size() >= uart_out_buf_size)
+            flush();
+        break;
+    }
+    case IER_DLM: {
+        if (dlab)
+            dlm = value;
+        else
+            ier = value & 0x0f;
+        break;
+    }
+    case IIR_FCR: {
+        fcr = value;
+        if (value & fcr_clear_rx)
+            in_buf.clear();
+        break;
+    }
+    case LCR: {
+        lcr = value;
+        break;
+    }
+    case MCR: {
+        mcr = value;
+        break;
+    }
+    case SCR: {
+        scr = value;
+        break;
+    }
+    // LSR and MSR are read only
+    }
+}
+
+void Uart::flush() {
+    if (out_buf.empty())
+        return;
+
+    if (capture != nullptr) {
+        std::size_t room = capture_limit - std::min(capture_limit, capture->size());
+        std::size_t kept = std::min(room, out_buf.size());
+        capture->append(out_buf.begin(), out_buf.begin() + kept);
+        dropped += out_buf.size() - kept;
+        out_buf.clear();
+        return;
+    }
+
+    // Anything the emulator itself printed came first, keep it that way. The emulator flushes the UART before it
+    // prints, so the order holds the other way around as well.
+    std::cout.flush();
+
+    std::size_t written = 0;
+    while (written < out_buf.size()) {
+        auto cnt = ::write(STDOUT_FILENO, out_buf.data() + written, out_buf.size() - written);
+        if (cnt < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("error while writing uart output");
+            break;
+        }
+        written += cnt;
+    }
+
+    out_buf.clear();
+}
+
+void Uart::reset() {
+    out_buf.clear();
+    in_buf.clear();
+    polls_skipped = poll_interval;
+    in_eof = in_disabled;
+    dropped = 0;
+    ier = fcr = lcr = mcr = scr = dll = dlm = 0;
+}
+
+void Uart::capture_output(std::string *dest, std::size_t limit) {
+    flush();
+    capture = dest;
+    capture_limit = limit;
+}
+
+void Uart::disable_input() {
+    in_buf.clear();
+    in_disabled = in_eof = true;
+}
+
+void Uart::poll_input() {
+    polls_skipped = 0;
+
+    if (in_eof)
+        return;
+
+    pollfd fd{.fd = STDIN_FILENO, .events = POLLIN, .revents = 0};
+    if (poll(&fd, 1, 0) <= 0 || (fd.revents & (POLLIN | POLLHUP)) == 0)
+        return;
+
+    std::array<uint8_t, 256> chunk;
+    auto cnt = ::read(STDIN_FILENO, chunk.data(), chunk.size());
+    if (cnt <= 0) {
+        in_eof = cnt == 0;
+        return;
+    }
+
+    in_buf.insert(in_buf.end(), chunk.begin(), chunk.begin() + cnt);
+}
@@ -0,0 +1,15 @@
+#!/usr/bin/bash
+
+# Runs cache/cache.bin on a small direct mapped L1D and checks what it counted, see cache/cache.S
+# Usage: ./cache.sh EMULATOR
+
+EMU="$1"
+PROGRAM="$(dirname "$0")/cache/cache.bin"
+
+EXPECTED=$'L1D:\taccesses: 49\tmisses: 32 (65.31%)\twritebacks: 1'
+OUTPUT="$("$EMU" --trace=0 --l1d=1k:1:64 "$PROGRAM" 2>&1 >/dev/null | grep '^L1D:')"
+
+if [ "$OUTPUT" != "$EXPECTED" ]; then
+    echo "$PROGRAM: expected \"$EXPECTED\", got \"$OUTPUT\""
+    exit 1
+fi
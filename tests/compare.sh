@@ -0,0 +1,39 @@
+#!/usr/bin/bash
+
+# Runs a test program plainly and in every other mode that should leave it printing the same, and fails unless
+# they all do and exit with the same code.
+# Usage: ./compare.sh EMULATOR PROGRAM
+
+EMU="$1"
+PROGRAM="$2"
+
+# Native modules go to a cache of their own, so runs don't pick up or leave behind anything
+CACHE="$(mktemp -d)"
+trap 'rm -rf "$CACHE"' EXIT
+
+EXPECTED="$("$EMU" "$PROGRAM")"
+EXPECTED_RC=$?
+
+STATUS=0
+# Runs the program with the given options, expecting the first argument as its output
+check() {
+    local expected="$1" output rc
+    shift
+    output="$(XDG_CACHE_HOME="$CACHE" "$EMU" "$@" "$PROGRAM" 2>/dev/null)"
+    rc=$?
+    if [ "$output" != "$expected" ] || [ $rc -ne $EXPECTED_RC ]; then
+        echo "$PROGRAM: $* differs from the plain run"
+        diff <(echo "$expected") <(echo "$output") | head -20
+        STATUS=1
+    fi
+}
+
+check "$EXPECTED" --aot
+check "$EXPECTED" --loop-idioms
+check "$EXPECTED" --cache-sim
+# Lanes execute every ECALL together, so each register dump shows up once per lane in a row. Their lane number
+# starts out in x10, which the programs set before printing.
+check "$(echo "$EXPECTED" | awk '/^ecall @/ && dump != "" { for (i = 0; i < 4; i++) printf "%s", dump; dump = "" }
+    { dump = dump $0 "\n" } END { for (i = 0; i < 4; i++) printf "%s", dump }')" --lockstep=4
+
+exit $STATUS
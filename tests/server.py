@@ -0,0 +1,105 @@
+#!/usr/bin/env python3
+
+# Runs the emulator as a server and checks its responses to a guest that exits, one out of budget, one that
+# faults, and malformed requests, see server.hpp.
+# Usage: ./server.py EMULATOR
+
+import os
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+MAGIC = 0x4d455652
+JOB_PATH, JOB_IMAGE = 0, 1
+STATUS_EXITED, STATUS_BUDGET_EXHAUSTED, STATUS_FAULT, STATUS_BAD_REQUEST = 0, 1, 2, 3
+
+REQUEST = struct.Struct('=IIQQ')
+RESPONSE = struct.Struct('=IiQQQQQ')
+
+emu = sys.argv[1]
+program = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'server', 'server.bin')
+failures = 0
+
+
+def check(what, cond):
+    global failures
+    if not cond:
+        print(f'{program}: {what}')
+        failures += 1
+
+
+def recv_exact(conn, size):
+    data = b''
+    while len(data) < size:
+        try:
+            chunk = conn.recv(size - len(data))
+        except ConnectionResetError:
+            chunk = b''
+        if not chunk:
+            return None
+        data += chunk
+    return data
+
+
+def job(conn, kind, payload, budget=0, magic=MAGIC):
+    conn.sendall(REQUEST.pack(magic, kind, budget, len(payload)) + payload)
+    header = recv_exact(conn, RESPONSE.size)
+    if header is None:
+        return None
+    status, exit_code, retired, _, output_length, output_dropped, message_length = RESPONSE.unpack(header)
+    output = recv_exact(conn, output_length)
+    message = recv_exact(conn, message_length).decode()
+    return status, exit_code, retired, output, output_dropped, message
+
+
+with tempfile.TemporaryDirectory() as tmp:
+    path = os.path.join(tmp, 'sock')
+
+    # Anything but a socket at the path is left alone
+    with open(path, 'w') as f:
+        f.write('keep')
+    rc = subprocess.run([emu, f'--serve={path}', '--workers=1'], capture_output=True).returncode
+    check('server started over a regular file', rc != 0 and open(path).read() == 'keep')
+    os.unlink(path)
+
+    server = subprocess.Popen([emu, f'--serve={path}', '--workers=2', '--pool=1'])
+    try:
+        for _ in range(100):
+            if os.path.exists(path):
+                break
+            time.sleep(0.05)
+
+        conn = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        conn.connect(path)
+        image = open(program, 'rb').read()
+
+        # A pool of one has to be reset between jobs, they all go over the same connection
+        resp = job(conn, JOB_IMAGE, image)
+        check(f'image job: {resp}', resp == (STATUS_EXITED, 3, 10, b'hi\n', 0, ''))
+        resp = job(conn, JOB_PATH, program.encode())
+        check(f'path job: {resp}', resp == (STATUS_EXITED, 3, 10, b'hi\n', 0, ''))
+        resp = job(conn, JOB_IMAGE, image, budget=5)
+        check(f'budget: {resp}', resp is not None and resp[0] == STATUS_BUDGET_EXHAUSTED and resp[3] == b'hi')
+        resp = job(conn, JOB_IMAGE, bytes(16))
+        check(f'fault: {resp}', resp is not None and resp[0] == STATUS_FAULT and 'invalid instruction' in resp[5])
+        resp = job(conn, JOB_PATH, os.path.join(tmp, 'missing').encode())
+        check(f'missing file: {resp}', resp is not None and resp[0] == STATUS_BAD_REQUEST and resp[5] != '')
+
+        # The connection survives all of the above, but not a request it can't skip the payload of
+        resp = job(conn, 7, b'')
+        check(f'malformed request: {resp}', resp is not None and resp[0] == STATUS_BAD_REQUEST)
+        check('connection open after a malformed request', recv_exact(conn, 1) is None)
+        conn.close()
+
+        conn = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        conn.connect(path)
+        check('connection open after a bad magic', job(conn, JOB_IMAGE, image, magic=0) is None)
+        conn.close()
+    finally:
+        server.kill()
+        server.wait()
+
+sys.exit(1 if failures else 0)
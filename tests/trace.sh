@@ -0,0 +1,43 @@
+#!/usr/bin/bash
+
+# Traces trace/trace.bin and decodes the trace again, failing unless the decoder finds it consistent, sees every
+# retired instruction, and ends on the registers the emulator dumped at exit.
+# Usage: ./trace.sh EMULATOR DECODER
+
+EMU="$1"
+DECODE="$2"
+PROGRAM="$(dirname "$0")/trace/trace.bin"
+
+TRACE="$(mktemp)"
+STATS="$(mktemp)"
+trap 'rm -f "$TRACE" "$STATS"' EXIT
+
+# The last dump, at the exit ecall, without x0
+EXPECTED="$("$EMU" --stats --bin-trace="$TRACE" "$PROGRAM" 2>"$STATS" |
+    awk '/^ecall @/ { dump = "" } /^x/ { dump = dump $1 "\t" $2 "\n" $3 "\t" $4 "\n" } END { printf "%s", dump }' |
+    tail -n +2)"
+RETIRED="$(awk '/^retired:/ { print $2 }' "$STATS")"
+
+STATUS=0
+# Keyframe mismatches only go to stderr
+ERRORS="$("$DECODE" --image="$PROGRAM" "$TRACE" 2>&1 >/dev/null)"
+if [ -n "$ERRORS" ]; then
+    echo "$PROGRAM: the trace disagrees with itself"
+    echo "$ERRORS" | head -20
+    STATUS=1
+fi
+
+LINES="$("$DECODE" "$TRACE" | wc -l)"
+if [ "$LINES" != "$RETIRED" ]; then
+    echo "$PROGRAM: $RETIRED instructions retired, but $LINES were decoded"
+    STATUS=1
+fi
+
+OUTPUT="$("$DECODE" --state "$TRACE" | awk '/^state after/ { final = 1; next } final')"
+if [ "$OUTPUT" != "$EXPECTED" ]; then
+    echo "$PROGRAM: the decoded final state differs from the emulator's"
+    diff <(echo "$EXPECTED") <(echo "$OUTPUT") | head -20
+    STATUS=1
+fi
+
+exit $STATUS
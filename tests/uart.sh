@@ -0,0 +1,16 @@
+#!/usr/bin/bash
+
+# Runs uart/uart.bin with "ok" piped to its stdin and checks that it echoed it back and passed, see uart/uart.S
+# Usage: ./uart.sh EMULATOR
+
+EMU="$1"
+PROGRAM="$(dirname "$0")/uart/uart.bin"
+
+EXPECTED=$'ready\nok'
+OUTPUT="$(printf 'ok' | "$EMU" --trace=0 "$PROGRAM")"
+RC=$?
+
+if [ "$OUTPUT" != "$EXPECTED" ] || [ $RC -ne 0 ]; then
+    echo "$PROGRAM: expected \"$EXPECTED\" and exit code 0, got \"$OUTPUT\" and $RC"
+    exit 1
+fi
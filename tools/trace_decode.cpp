@@ -0,0 +1,291 @@
+#include <iostream>
+#include <array>
+#include <memory>
+#include <optional>
+#include <format>
+#include <stdexcept>
+#include <cstdio>
+#include <cstdlib>
+#include <string_view>
+#include <vector>
+#include <cstring>
+
+#include "isa.hpp"
+#include "trace.hpp"
+
+/* Turns a trace written by `riscv-emu --bin-trace` back into text, see trace.hpp for the format.
+ *
+ * By default every instruction gets a line with its index, pc, and the register and memory writes it made.
+ * With --state, the register file is printed instead, one register per line, at every keyframe and after the
+ * last instruction, so that the traces of two runs can be compared with diff(1). Either way, keyframes are
+ * checked against the state rebuilt from the records before them.
+ *
+ * With --image, the flat image the run started from is loaded at address 0 and kept up to date with the memory
+ * writes in the trace, so that every line also shows the instruction that was executed. The pages in keyframes
+ * are then checked against it as well.
+ * */
+
+// Far more than the emulator gives a guest, only a corrupt trace writes past it
+constexpr uint64_t max_memory = uint64_t{1} << 32;
+
+static void usage(const char *name) {
+    std::cerr << "Usage: " << name << " [--state[=N]] [--image=FILE] TRACE\n"
+        << "  --state          print the register file at every keyframe and at the end\n"
+        << "  --state=N        print the register file every N instructions and at the end\n"
+        << "  --image=FILE     disassemble the executed instructions, FILE being the image the trace was run on\n";
+}
+
+struct TraceFile {
+    FILE *file;
+    uint64_t offset{0};
+
+    // Returns false at the end of the file
+    bool get(uint8_t &byte) {
+        int c = getc(file);
+        if (c == EOF)
+            return false;
+        byte = c;
+        offset++;
+        return true;
+    }
+
+    uint8_t byte() {
+        uint8_t b;
+        if (!get(b))
+            throw std::runtime_error(std::format("trace truncated at offset {}", offset));
+        return b;
+    }
+
+    uint64_t uleb() {
+        uint64_t value = 0;
+        for (unsigned shift = 0;; shift += 7) {
+            uint8_t b = byte();
+            if (shift < 64)
+                value |= static_cast<uint64_t>(b & 0x7f) << shift;
+            if (!(b & 0x80))
+                return value;
+        }
+    }
+
+    int64_t sleb() {
+        uint64_t value = 0;
+        unsigned shift = 0;
+        uint8_t b;
+        do {
+            b = byte();
+            if (shift < 64)
+                value |= static_cast<uint64_t>(b & 0x7f) << shift;
+            shift += 7;
+        } while (b & 0x80);
+        if (shift < 64 && (b & 0x40))
+            value |= ~uint64_t{0} << shift;
+        return static_cast<int64_t>(value);
+    }
+
+    uint64_t le64() {
+        uint64_t value = 0;
+        for (std::size_t i = 0; i < 8; i++)
+            value |= static_cast<uint64_t>(byte()) << (8 * i);
+        return value;
+    }
+};
+
+// The pc is only known ahead of an instruction, the final state goes without one
+static void print_state(uint64_t index, std::optional<uint64_t> pc, const std::array<int64_t, 32> &registers) {
+    if (pc)
+        std::cout << std::format("state before {} @ 0x{:08x}\n", index, *pc);
+    else
+        std::cout << std::format("state after {}\n", index);
+    for (std::size_t reg = 1; reg < registers.size(); reg++)
+        std::cout << std::format("x{}:\t0x{:016x}\n", reg, static_cast<uint64_t>(registers[reg]));
+}
+
+// Checks that a write of size bytes at addr is one the emulator could have made, and when memory is tracked, grows
+// it to cover the write. Memory past the image starts out zeroed, like the guest's does.
+static void grow(std::vector<uint8_t> &memory, uint64_t addr, uint64_t size, bool tracked, uint64_t offset) {
+    if (addr >= max_memory || max_memory - addr < size)
+        throw std::runtime_error(std::format("bad memory write at offset {}", offset));
+    if (tracked && memory.size() < addr + size)
+        memory.resize(addr + size);
+}
+
+static std::vector<uint8_t> load_image(const char *path) {
+    std::unique_ptr<FILE, int (*)(FILE *)> file{fopen(path, "rb"), fclose};
+    if (file == nullptr) {
+        perror("error while opening image");
+        throw std::runtime_error(std::format("can't open image {}", path));
+    }
+
+    std::vector<uint8_t> image;
+    uint8_t buffer[4096];
+    for (std::size_t n; (n = fread(buffer, 1, sizeof(buffer), file.get())) > 0;)
+        image.insert(image.end(), buffer, buffer + n);
+    if (ferror(file.get())) {
+        perror("error while reading image");
+        throw std::runtime_error(std::format("can't read image {}", path));
+    }
+    return image;
+}
+
+int main(int argc, char **argv) {
+    const char *path = nullptr;
+    const char *image_path = nullptr;
+    bool state = false;
+    uint64_t state_interval = 0;
+
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (arg == "--state") {
+            state = true;
+        } else if (arg.starts_with("--state=")) {
+            state = true;
+            state_interval = std::strtoull(argv[i] + 8, nullptr, 0);
+            if (state_interval == 0) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg.starts_with("--image=") && arg.size() > 8) {
+            image_path = argv[i] + 8;
+        } else if (path == nullptr && !arg.starts_with("--")) {
+            path = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (path == nullptr) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::unique_ptr<FILE, int (*)(FILE *)> file{fopen(path, "rb"), fclose};
+    if (file == nullptr) {
+        perror("error while opening trace file");
+        return 1;
+    }
+
+    std::vector<uint8_t> memory;
+    try {
+        if (image_path != nullptr)
+            memory = load_image(image_path);
+    } catch (const std::runtime_error &e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+
+    TraceFile trace{file.get()};
+    std::array<int64_t, 32> registers{};
+    uint64_t index = 0;
+    uint64_t next_pc = 0;
+    bool synced = false;
+
+    try {
+        for (char c : trace_magic) {
+            if (trace.byte() != static_cast<uint8_t>(c))
+                throw std::runtime_error("not a trace file");
+        }
+        uint64_t keyframe_interval = trace.le64();
+        if (state && state_interval == 0)
+            state_interval = keyframe_interval;
+
+        for (uint8_t tag; trace.get(tag);) {
+            if (tag & TRACE_KEYFRAME) {
+                uint64_t key_index = trace.uleb();
+                uint64_t key_pc = trace.uleb();
+                std::array<int64_t, 32> key_registers{};
+                for (std::size_t reg = 1; reg < key_registers.size(); reg++)
+                    key_registers[reg] = trace.le64();
+
+                // The pc can't be checked, a jump only shows in the delta of the record after it
+                if (synced && (key_index != index || key_registers != registers))
+                    std::cerr << std::format("keyframe at offset {} disagrees with the records before it\n",
+                            trace.offset);
+
+                uint64_t pages = trace.uleb();
+                for (uint64_t i = 0; i < pages; i++) {
+                    uint64_t addr = trace.uleb() * trace_page_size;
+                    bool differs = false;
+                    grow(memory, addr, trace_page_size, image_path != nullptr, trace.offset);
+                    for (std::size_t offset = 0; offset < trace_page_size; offset++) {
+                        uint8_t b = trace.byte();
+                        if (image_path != nullptr) {
+                            differs |= memory[addr + offset] != b;
+                            memory[addr + offset] = b;
+                        }
+                    }
+                    if (synced && differs)
+                        std::cerr << std::format("page 0x{:08x} at offset {} disagrees with the records before it\n",
+                                addr, trace.offset);
+                }
+
+                index = key_index;
+                next_pc = key_pc;
+                registers = key_registers;
+                synced = true;
+
+                if (!(tag & ~TRACE_KEYFRAME))
+                    continue;
+                tag &= ~TRACE_KEYFRAME;
+            }
+
+            if (!synced)
+                throw std::runtime_error("trace doesn't start with a keyframe");
+
+            uint64_t pc = next_pc;
+            if (tag & TRACE_JUMP)
+                pc += trace.sleb();
+
+            if (state && index % state_interval == 0)
+                print_state(index, pc, registers);
+
+            std::string line = std::format("{}\t0x{:08x}", index, pc);
+            // The instruction is read before this record's writes, which come after it ran
+            if (image_path != nullptr) {
+                uint32_t inst = 0;
+                if (pc < memory.size() && memory.size() - pc >= 4)
+                    std::memcpy(&inst, memory.data() + pc, 4);
+                line += std::format("\t{}", disassemble(inst, pc));
+            }
+            if (tag & TRACE_REG) {
+                uint8_t rd = trace.byte();
+                if (rd == 0 || rd >= registers.size())
+                    throw std::runtime_error(std::format("bad register x{} at offset {}", rd, trace.offset));
+                registers[rd] = trace.sleb();
+                line += std::format("\tx{} = 0x{:016x}", rd, static_cast<uint64_t>(registers[rd]));
+            }
+            if (tag & TRACE_MEM) {
+                uint64_t addr = trace.uleb();
+                uint64_t size = trace.uleb();
+                // Only stores are short enough to show, bulk writes just get their extent
+                uint64_t value = 0;
+                grow(memory, addr, size, image_path != nullptr, trace.offset);
+                for (uint64_t i = 0; i < size; i++) {
+                    uint8_t b = trace.byte();
+                    if (i < 8)
+                        value |= static_cast<uint64_t>(b) << (8 * i);
+                    if (image_path != nullptr)
+                        memory[addr + i] = b;
+                }
+                if (size <= 8)
+                    line += std::format("\t[0x{:08x}] = 0x{:x} ({} bytes)", addr, value, size);
+                else
+                    line += std::format("\t[0x{:08x}] ({} bytes)", addr, size);
+            }
+
+            if (!state)
+                std::cout << line << "\n";
+
+            next_pc = pc + 4;
+            index++;
+        }
+    } catch (const std::runtime_error &e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+
+    if (state && synced)
+        print_state(index, std::nullopt, registers);
+
+    return 0;
+}